@@ -1,40 +1,27 @@
 #pragma once
 #include "board.h"
 #include <algorithm>
+#include <iostream>
 #include <string>
-#include <unordered_map>
+#include <type_traits>
 
+/**
+ * the action as a value of 32 bits, i.e., the type in the highest byte and the
+ * event of the type in the others
+ * the type is decoded by a switch instead of virtual calls, hence an action is
+ * trivially copyable, and a slide or a place converts to and from an action
+ */
 class action {
 public:
   action(unsigned code = -1u) : code(code) {}
-  action(const action &a) : code(a.code) {}
-  virtual ~action() {}
 
   class slide; // create a sliding action with board opcode
   class place; // create a placing action with position and tile
 
 public:
-  virtual board::reward_t apply(board &b) const {
-    auto proto = entries().find(type());
-    if (proto != entries().end())
-      return proto->second->reinterpret(this).apply(b);
-    return -1;
-  }
-  virtual std::ostream &operator>>(std::ostream &out) const {
-    auto proto = entries().find(type());
-    if (proto != entries().end())
-      return proto->second->reinterpret(this) >> out;
-    return out << "??";
-  }
-  virtual std::istream &operator<<(std::istream &in) {
-    auto state = in.rdstate();
-    for (auto proto = entries().begin(); proto != entries().end(); proto++) {
-      if (proto->second->reinterpret(this) << in)
-        return in;
-      in.clear(state);
-    }
-    return in.ignore(2);
-  }
+  board::reward_t apply(board &b) const;
+  std::ostream &operator>>(std::ostream &out) const;
+  std::istream &operator<<(std::istream &in);
 
 public:
   operator unsigned() const { return code; }
@@ -50,15 +37,6 @@ public:
 protected:
   static constexpr unsigned type_flag(unsigned v) { return v << 24; }
 
-  typedef std::unordered_map<unsigned, action *> prototype;
-  static prototype &entries() {
-    static prototype m;
-    return m;
-  }
-  virtual action &reinterpret(const action *a) const {
-    return *new (const_cast<action *>(a)) action(*a);
-  }
-
   unsigned code;
 };
 
@@ -87,14 +65,6 @@ public:
     in.setstate(std::ios::failbit);
     return in;
   }
-
-protected:
-  action &reinterpret(const action *a) const {
-    return *new (const_cast<action *>(a)) slide(*a);
-  }
-  static __attribute__((constructor)) void init() {
-    entries()[type_flag('s')] = new slide;
-  }
 };
 
 class action::place : public action {
@@ -127,12 +97,51 @@ public:
     in.setstate(std::ios::failbit);
     return in;
   }
+};
 
-protected:
-  action &reinterpret(const action *a) const {
-    return *new (const_cast<action *>(a)) place(*a);
+static_assert(std::is_trivially_copyable<action>::value &&
+                  std::is_trivially_copyable<action::slide>::value &&
+                  std::is_trivially_copyable<action::place>::value,
+              "action should be a value of 32 bits");
+
+inline board::reward_t action::apply(board &b) const {
+  switch (type()) {
+  case slide::type:
+    return slide(*this).apply(b);
+  case place::type:
+    return place(*this).apply(b);
+  default:
+    return -1;
   }
-  static __attribute__((constructor)) void init() {
-    entries()[type_flag('p')] = new place;
+}
+
+inline std::ostream &action::operator>>(std::ostream &out) const {
+  switch (type()) {
+  case slide::type:
+    return slide(*this) >> out;
+  case place::type:
+    return place(*this) >> out;
+  default:
+    return out << "??";
   }
-};
+}
+
+/**
+ * parse a place, or else a slide, and skip 2 characters if neither
+ */
+inline std::istream &action::operator<<(std::istream &in) {
+  auto state = in.rdstate();
+  place p;
+  if (p << in) {
+    *this = p;
+    return in;
+  }
+  in.clear(state);
+  slide s;
+  if (s << in) {
+    *this = s;
+    return in;
+  }
+  in.clear(state);
+  return in.ignore(2);
+}
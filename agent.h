@@ -1,15 +1,27 @@
 #pragma once
 #include "action.h"
 #include "board.h"
+#include "cpu.h"
 #include "pattern.h"
+#include "rng.h"
 #include <algorithm>
 #include <array>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <iostream>
 #include <map>
-#include <random>
+#include <memory>
+#include <numeric>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <tuple>
 #include <type_traits>
+#include <utility>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 class agent {
 public:
@@ -54,53 +66,199 @@ protected:
 
 class random_agent : public agent {
 public:
-  random_agent(const std::string &args = "") : agent(args) {
-    if (meta.find("seed") != meta.end())
-      engine.seed(int(meta["seed"]));
+  random_agent(const std::string &args = "") : agent("seed=0 " + args) {
+    root.seed(std::stoull(property("seed")));
   }
   virtual ~random_agent() {}
 
+  /**
+   * every episode draws from its own stream of the seed, so that a seed
+   * reproduces the same games however the episodes are shared by the workers
+   */
+  virtual void open_episode(const std::string &flag = "") {
+    engine = root.split(episodes++);
+  }
+  /**
+   * set the index of the next episode, e.g., the one reserved by a worker
+   */
+  void seek(size_t episode) { episodes = episode; }
+
 protected:
-  std::default_random_engine engine;
+  xoshiro256 engine;
+
+private:
+  xoshiro256 root;
+  size_t episodes = 0;
 };
 
 /**
  * base agent for agents with weight tables
  */
-class weight_agent : public agent {
+template <class... patterns> class weight_agent : public agent {
 public:
-  weight_agent(const std::string &args = "") : agent(args), alpha(0.1f) {
+  weight_agent(const std::string &args = "")
+      : agent("weights=fp32 pages=thp numa=local tc=0 " + args),
+        net(std::make_shared<network>()), alpha(0.1f),
+        storage(weight_table::storage(property("weights"))),
+        policy(property("pages"), property("numa")) {
     if (meta.find("alpha") != meta.end())
       alpha = float(meta["alpha"]);
+    // q16 only spans the weights it is converted from, which training could
+    // outgrow, see weight_table::convert
+    if (storage == weight_table::q16 && alpha != 0)
+      throw std::invalid_argument("weights=q16 is for inference (alpha=0)");
+    // the accumulators of TC learning are only kept for training
+    bool tc = int(meta["tc"]) != 0 && alpha != 0;
+    if (meta.find("load") != meta.end())
+      load_weights();
+    size_t bytes = 0, page = 0;
+    bool interleaved = true;
+    for_each([&](auto &p) {
+      if (p.table().size() == 0)
+        p.assign(weight_table(p.size(), storage, 1.0f / 16, policy));
+      else if (p.table().storage() != storage ||
+               (p.table().page() && p.table().policy() != policy))
+        p.assign(p.table().convert(storage, policy));
+      if (tc && p.coherence().size() == 0)
+        p.assign_coherence(
+            weight_table(2 * p.size(), weight_table::fp16, 1, policy));
+      bytes += p.table().bytes() + p.coherence().bytes();
+      page = std::max(page, p.table().page());
+      interleaved &= !p.table().page() || p.table().interleaved();
+    });
+    meta["tc"] = {tc ? "1" : "0"};
+    meta["weights"] = {weight_table::name(storage)};
+    meta["footprint"] = {std::to_string(bytes >> 20) + " MB"};
+    meta["pages"] = {page ? policy.name() +
+                                (interleaved ? "" : " (failed)") +
+                                ", " + std::to_string(page >> 10) + " kB pages"
+                          : "mapped file"};
+  }
+  virtual ~weight_agent() {
+    if (meta.find("save") != meta.end())
+      save_weights();
   }
-  virtual ~weight_agent() = default;
 
 protected:
+  /**
+   * share the weight tables of another agent
+   */
+  weight_agent(const weight_agent &) = default;
+
+  /**
+   * load the weights from 'load', either in the mapped format (see
+   * weight_file), which read-only agents (alpha=0) share with other
+   * processes, or in the streamed format
+   * the accumulators of TC learning, if any, follow the weights as their
+   * 16-bit pairs (see tuple_pattern::coherence) in the floats of the same
+   * bytes
+   */
   void load_weights() {
+    bool tc = int(meta["tc"]) != 0 && alpha != 0;
+    weight_file file = weight_file::map(meta.at("load"), alpha != 0);
+    if (file) {
+      for_each([&](auto &p) {
+        weight_table table = file.find(p.name());
+        if (table.size() == p.size())
+          p.assign(table);
+        table = file.find(coherence_name(p));
+        if (tc && table.size() == p.size()) {
+          // copied, since a view of the file is fp32
+          weight_table acc(2 * p.size(), weight_table::fp16, 1, policy);
+          std::memcpy(acc.template data<char>(), table.data(), acc.bytes());
+          p.assign_coherence(acc);
+        }
+      });
+      return;
+    }
     std::ifstream in(meta.at("load"), std::ios::in | std::ios::binary);
     if (!in.is_open()) {
       return;
     }
     uint32_t size;
     in.read(reinterpret_cast<char *>(&size), sizeof(size));
-    net.resize(size);
-    for (auto &p : net) {
-      in >> p;
+    assert(size == sizeof...(patterns));
+    for_each([&](auto &p) { in >> p; });
+    for (uint32_t len;
+         tc && in.read(reinterpret_cast<char *>(&len), sizeof(len));) {
+      std::string name(len, '\0');
+      uint64_t size = 0;
+      in.read(&name[0], len);
+      in.read(reinterpret_cast<char *>(&size), sizeof(size));
+      for_each([&](auto &p) {
+        if (name != coherence_name(p) || size != p.size())
+          return;
+        weight_table acc(2 * p.size(), weight_table::fp16, 1, policy);
+        in.read(acc.template data<char>(), acc.bytes());
+        p.assign_coherence(acc);
+        size = 0;
+      });
+      in.ignore(sizeof(float) * size);
     }
     in.close();
   }
+  /**
+   * save the weights to 'save', in the mapped format if 'format=map'
+   * the file is written as 'save.part' and renamed to 'save' once complete,
+   * since the tables may be mapped from the very file being saved
+   */
   void save_weights() const {
-    std::ofstream out(meta.at("save"),
-                      std::ios::out | std::ios::binary | std::ios::trunc);
+    std::string path = meta.at("save"), part = path + ".part";
+    std::ofstream out(part, std::ios::out | std::ios::binary | std::ios::trunc);
     if (!out.is_open()) {
+      std::perror(part.c_str());
       return;
     }
-    uint32_t size = net.size();
-    out.write(reinterpret_cast<char *>(&size), sizeof(size));
-    for (auto &p : net) {
-      out << p;
-    }
+    write_weights(out);
     out.close();
+    if (!out) {
+      std::cerr << part << ": failed to write the weights" << std::endl;
+      std::remove(part.c_str());
+      return;
+    }
+    if (std::rename(part.c_str(), path.c_str()) != 0)
+      std::perror(path.c_str());
+  }
+  void write_weights(std::ostream &out) const {
+    auto format = meta.find("format");
+    if (format != meta.end() && format->second.value == "map") {
+      std::vector<weight_table> tables;
+      std::vector<std::pair<std::string, const weight_table *>> entries;
+      for_each([&](const auto &p) {
+        tables.push_back(p.table().storage() == weight_table::fp32
+                             ? p.table()
+                             : p.table().convert(weight_table::fp32));
+      });
+      for_each([&](const auto &p) {
+        entries.emplace_back(p.name(), &tables[entries.size()]);
+      });
+      for_each([&](const auto &p) {
+        if (p.coherence().size())
+          entries.emplace_back(coherence_name(p), &p.coherence());
+      });
+      weight_file::write(out, entries);
+      return;
+    }
+    uint32_t size = sizeof...(patterns);
+    out.write(reinterpret_cast<char *>(&size), sizeof(size));
+    for_each([&](const auto &p) { out << p; });
+    // the streamed loader before TC learning stops after the patterns
+    for_each([&](const auto &p) {
+      if (p.coherence().size() == 0)
+        return;
+      std::string name = coherence_name(p);
+      uint32_t len = name.length();
+      // the 16-bit pairs as the floats of the same bytes, see load_weights
+      uint64_t size = p.coherence().bytes() / sizeof(float);
+      out.write(reinterpret_cast<char *>(&len), sizeof(len));
+      out.write(name.c_str(), len);
+      out.write(reinterpret_cast<char *>(&size), sizeof(size));
+      out.write(p.coherence().template data<char>(), sizeof(float) * size);
+    });
+  }
+
+  template <class pattern> static std::string coherence_name(const pattern &p) {
+    return p.name() + " coherence";
   }
 
 protected:
@@ -108,76 +266,305 @@ protected:
    * accumulate the total value of given state
    */
   float estimate(const board &b) const {
-    float value = 0;
-    for (auto &p : net) {
-      value += p.estimate(b);
-    }
+    float value;
+    estimate(&b, &value, 1);
     return value;
   }
 
+  /**
+   * accumulate the total values of n states at once, e.g., the afterstates
+   * gather the weights with AVX-512 (two states at once) or AVX2 if the CPU
+   * supports it, all the paths sum the weights in the same order so that the
+   * results are identical
+   */
+  void estimate(const board *b, float *value, size_t n) const {
+    switch (storage) {
+    case weight_table::fp16:
+      return estimate<weight_table::fp16>(b, value, n);
+    case weight_table::q16:
+      return estimate<weight_table::q16>(b, value, n);
+    default:
+      return estimate<weight_table::fp32>(b, value, n);
+    }
+  }
+
   /**
    * update the value of given state and return its new value
    */
   float update(const board &b, float u) {
-    float u_split = u / net.size();
-    float value = 0;
-    for (auto &p : net) {
-      value += p.update(b, u_split);
+    switch (storage) {
+    case weight_table::fp16:
+      return update<weight_table::fp16>(b, u);
+    case weight_table::q16:
+      return update<weight_table::q16>(b, u);
+    default:
+      return update<weight_table::fp32>(b, u);
     }
+  }
+
+protected:
+  template <weight_table::storage_t s>
+  void estimate(const board *b, float *value, size_t n) const {
+    size_t i = 0;
+    for (; cpu::avx512f() && i + 2 <= n; i += 2) {
+      const symmetry iso[] = {symmetry(b[i]), symmetry(b[i + 1])};
+      estimate_avx512<s>(iso, value + i, indices());
+    }
+    for (; cpu::avx2() && i < n; i++)
+      value[i] = estimate_avx2<s>(symmetry(b[i]), indices());
+    for (; i < n; i++)
+      value[i] = estimate_scalar<s>(symmetry(b[i]));
+  }
+
+  template <weight_table::storage_t s> float update(const board &b, float u) {
+    const symmetry iso(b);
+    float u_split = u / sizeof...(patterns);
+    float value = 0;
+    for_each([&](auto &p) { value += p.template update<s>(iso, u_split); });
     return value;
   }
 
+  /**
+   * the weights are summed per isomorphism over the patterns in order, then
+   * the 8 partial sums are reduced by halves as the vector units do
+   */
+  template <weight_table::storage_t s>
+  float estimate_scalar(const symmetry &iso) const {
+    using codec = weight_codec<s>;
+    std::array<float, 8> sum{};
+    for_each([&](const auto &p) {
+      auto index = p.indexof(iso);
+      auto *weight = p.table().template data<typename codec::type>();
+      float scale = p.table().scale();
+      for (size_t i = 0; i < sum.size(); i++)
+        sum[i] += codec::decode(weight[index[i]], scale);
+    });
+    for (size_t half = sum.size() / 2; half; half /= 2) {
+      for (size_t i = 0; i < half; i++)
+        sum[i] += sum[i + half];
+    }
+    return sum[0];
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  template <weight_table::storage_t s, size_t... p>
+  __attribute__((target("avx2"))) float
+  estimate_avx2(const symmetry &iso, std::index_sequence<p...>) const {
+    __m256 sum = _mm256_setzero_ps();
+    (void)std::initializer_list<int>{
+        (sum = _mm256_add_ps(sum, gather_avx2<s>(std::get<p>(*net), iso)),
+         0)...};
+    return reduce_avx2(sum);
+  }
+
+  template <weight_table::storage_t s, size_t... p>
+  __attribute__((target("avx512f"))) void
+  estimate_avx512(const symmetry *iso, float *value,
+                  std::index_sequence<p...>) const {
+    __m512 sum = _mm512_setzero_ps();
+    (void)std::initializer_list<int>{
+        (sum = _mm512_add_ps(sum, gather_avx512<s>(std::get<p>(*net), iso)),
+         0)...};
+    value[0] = reduce_avx2(_mm512_castps512_ps256(sum));
+    value[1] = reduce_avx2(_mm256_castpd_ps(
+        _mm512_extractf64x4_pd(_mm512_castps_pd(sum), 1)));
+  }
+
+private:
+  /**
+   * gather the weights as float, the 16-bit weights are gathered as 32-bit
+   * ones (the tables are padded) and decoded in the same way as weight_codec
+   */
+  template <weight_table::storage_t s, class pattern>
+  __attribute__((target("avx2"))) static __m256
+  gather_avx2(const pattern &p, const symmetry &iso) {
+    alignas(32) uint32_t index[8];
+    std::copy_n(p.indexof(iso).begin(), 8, index);
+    __m256i vindex = _mm256_load_si256(reinterpret_cast<__m256i *>(index));
+    const void *base = p.table().template data<char>();
+    if (s == weight_table::fp32)
+      return _mm256_i32gather_ps(static_cast<const float *>(base), vindex, 4);
+    __m256i w =
+        _mm256_i32gather_epi32(static_cast<const int *>(base), vindex, 2);
+    if (s == weight_table::fp16) {
+      __m256i bits = _mm256_slli_epi32(
+          _mm256_and_si256(w, _mm256_set1_epi32(0x7fff)), 13);
+      __m256i sign = _mm256_slli_epi32(
+          _mm256_and_si256(w, _mm256_set1_epi32(0x8000)), 16);
+      __m256 v = _mm256_mul_ps(
+          _mm256_castsi256_ps(bits),
+          _mm256_set1_ps(weight_codec<weight_table::fp16>::rebias));
+      return _mm256_or_ps(v, _mm256_castsi256_ps(sign));
+    }
+    w = _mm256_srai_epi32(_mm256_slli_epi32(w, 16), 16);
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(w),
+                         _mm256_set1_ps(p.table().scale()));
+  }
+
+  template <weight_table::storage_t s, class pattern>
+  __attribute__((target("avx512f"))) static __m512
+  gather_avx512(const pattern &p, const symmetry *iso) {
+    alignas(64) uint32_t index[16];
+    std::copy_n(p.indexof(iso[0]).begin(), 8, index);
+    std::copy_n(p.indexof(iso[1]).begin(), 8, index + 8);
+    __m512i vindex = _mm512_load_si512(index);
+    const void *base = p.table().template data<char>();
+    if (s == weight_table::fp32)
+      return _mm512_i32gather_ps(vindex, base, 4);
+    __m512i w = _mm512_i32gather_epi32(vindex, base, 2);
+    if (s == weight_table::fp16) {
+      __m512i bits = _mm512_slli_epi32(
+          _mm512_and_si512(w, _mm512_set1_epi32(0x7fff)), 13);
+      __m512i sign = _mm512_slli_epi32(
+          _mm512_and_si512(w, _mm512_set1_epi32(0x8000)), 16);
+      __m512 v = _mm512_mul_ps(
+          _mm512_castsi512_ps(bits),
+          _mm512_set1_ps(weight_codec<weight_table::fp16>::rebias));
+      return _mm512_castsi512_ps(
+          _mm512_or_si512(_mm512_castps_si512(v), sign));
+    }
+    w = _mm512_srai_epi32(_mm512_slli_epi32(w, 16), 16);
+    return _mm512_mul_ps(_mm512_cvtepi32_ps(w),
+                         _mm512_set1_ps(p.table().scale()));
+  }
+
+  __attribute__((target("avx2"))) static float reduce_avx2(__m256 sum) {
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum),
+                             _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_movehdup_ps(half));
+    return _mm_cvtss_f32(half);
+  }
+#else
+  template <weight_table::storage_t s, size_t... p>
+  float estimate_avx2(const symmetry &iso, std::index_sequence<p...>) const {
+    return estimate_scalar<s>(iso);
+  }
+  template <weight_table::storage_t s, size_t... p>
+  void estimate_avx512(const symmetry *iso, float *value,
+                       std::index_sequence<p...>) const {
+    value[0] = estimate_scalar<s>(iso[0]);
+    value[1] = estimate_scalar<s>(iso[1]);
+  }
+#endif
+
+private:
+  static std::index_sequence_for<patterns...> indices() { return {}; }
+
+  /**
+   * apply 'func' on each pattern of the network in order
+   */
+  template <class func> void for_each(func f) const {
+    for_each(f, std::index_sequence_for<patterns...>());
+  }
+  template <class func> void for_each(func f) {
+    for_each(f, std::index_sequence_for<patterns...>());
+  }
+  template <class func, size_t... i>
+  void for_each(func f, std::index_sequence<i...>) const {
+    (void)std::initializer_list<int>{(f(std::get<i>(*net)), 0)...};
+  }
+  template <class func, size_t... i>
+  void for_each(func f, std::index_sequence<i...>) {
+    (void)std::initializer_list<int>{(f(std::get<i>(*net)), 0)...};
+  }
+
 protected:
-  std::vector<pattern> net;
+  /**
+   * the weight tables may be shared by several agents, e.g. the training
+   * threads, which update them without locks (Hogwild)
+   */
+  using network = std::tuple<patterns...>;
+  std::shared_ptr<network> net;
   float alpha;
+  weight_table::storage_t storage;
+  weight_policy policy;
 };
 
-class tdl_agent : public weight_agent {
+/**
+ * TD learning player
+ * select the action of the best afterstate value, or search 'depth' moves
+ * ahead with expectimax if depth > 1
+ *
+ * the chance nodes enumerate the placements of rndenv, i.e., the empty cells
+ * at the edge of the slide (see board::edge), and the tiles left in its bag,
+ * which is tracked from the tiles placed during the episode
+ * the max nodes are cached in a transposition table of 2^tt entries, keyed
+ * on the board, the depth, and the bag
+ */
+class tdl_agent : public weight_agent<tuple_pattern<0, 1, 2, 3, 4, 5>,
+                                      tuple_pattern<4, 5, 6, 7, 8, 9>,
+                                      tuple_pattern<0, 1, 2, 4, 5, 6>,
+                                      tuple_pattern<4, 5, 6, 8, 9, 10>> {
 public:
   tdl_agent(const std::string &args = "")
-      : weight_agent("name=tdl role=player " + args) {
-    net.emplace_back(pattern({0, 1, 2, 3, 4, 5}));
-    net.emplace_back(pattern({4, 5, 6, 7, 8, 9}));
-    net.emplace_back(pattern({0, 1, 2, 4, 5, 6}));
-    net.emplace_back(pattern({4, 5, 6, 8, 9, 10}));
+      : weight_agent("name=tdl role=player depth=1 tt=20 " + args) {
     path_.reserve(20000);
-    if (meta.find("load") != meta.end())
-      load_weights();
+    init_search();
   }
-  ~tdl_agent() {
-    if (meta.find("save") != meta.end())
-      save_weights();
+  /**
+   * training worker 'id' of 'owner'
+   * share the weight tables of 'owner', but keep its own path and
+   * transposition table
+   */
+  tdl_agent(const tdl_agent &owner, size_t id) : weight_agent(owner) {
+    meta.erase("load");
+    meta.erase("save");
+    meta["worker"] = {std::to_string(id)};
+    path_.reserve(20000);
+    init_search();
+  }
+  virtual void open_episode(const std::string &flag = "") {
+    last_ = board();
+    bag_ = full_bag;
   }
-
   virtual action take_action(const board &before, unsigned) {
-    board after[] = {board(before), board(before), board(before),
-                     board(before)};
-    board::reward_t reward[] = {after[0].slide(0), after[1].slide(1),
-                                after[2].slide(2), after[3].slide(3)};
-    constexpr const float ninf = -std::numeric_limits<float>::max();
-    float value[] = {
-        reward[0] == -1 ? ninf : reward[0] + estimate(after[0]),
-        reward[1] == -1 ? ninf : reward[1] + estimate(after[1]),
-        reward[2] == -1 ? ninf : reward[2] + estimate(after[2]),
-        reward[3] == -1 ? ninf : reward[3] + estimate(after[3]),
-    };
-    float *max_value = std::max_element(value, value + 4);
-    if (*max_value > ninf) {
-      unsigned idx = max_value - value;
-      path_.emplace_back(state({.before = before,
-                                .after = after[idx],
-                                .op = idx,
-                                .reward = static_cast<float>(reward[idx]),
-                                .value = *max_value}));
-      return action::slide(idx);
+    if (depth_ > 1)
+      track(before);
+    const board::moves moves = before.slides();
+    if (!moves.legal)
+      return action();
+    const board *after = moves.after;
+    const board::reward_t *reward = moves.reward;
+    float estimates[4];
+    if (depth_ > 1) {
+      for (unsigned op = 0; op < 4; op++)
+        estimates[op] = moves.legal & (1u << op)
+                            ? expect(after[op], op, bag_, depth_ - 1)
+                            : 0;
+    } else {
+      estimate(after, estimates, 4);
     }
-    path_.emplace_back(state());
-    return action();
+    constexpr const float ninf = -std::numeric_limits<float>::max();
+    float value[4];
+    for (unsigned op = 0; op < 4; op++)
+      value[op] =
+          moves.legal & (1u << op) ? reward[op] + estimates[op] : ninf;
+    unsigned idx = std::max_element(value, value + 4) - value;
+    last_ = after[idx];
+    // learn from the afterstate value, not from the search
+    float learnt = depth_ > 1 && alpha != 0
+                       ? reward[idx] + estimate(after[idx])
+                       : value[idx];
+    path_.emplace_back(state({.before = before,
+                              .after = after[idx],
+                              .op = idx,
+                              .reward = static_cast<float>(reward[idx]),
+                              .value = learnt}));
+    return action::slide(idx);
   }
 
+  /**
+   * learn from the moves of the episode backward, where the value after the
+   * last move is 0
+   */
   void update_episode() {
+    if (alpha == 0) {
+      path_.clear();
+      return;
+    }
     float exact = 0;
-    for (path_.pop_back(); path_.size(); path_.pop_back()) {
+    for (; path_.size(); path_.pop_back()) {
       state &move = path_.back();
       float error = exact - (move.value - move.reward);
       exact = move.reward + update(move.after, alpha * error);
@@ -185,6 +572,95 @@ public:
     path_.clear();
   }
 
+private:
+  /**
+   * the bag of rndenv as a mask of the tiles 1, 2, 3 left in it
+   * the bag is full at the first move, after the 9 initial tiles
+   */
+  static constexpr unsigned full_bag = 0b111;
+
+  static unsigned draw(unsigned bag, board::tile_t tile) {
+    bag &= ~(1u << (tile - 1));
+    return bag ? bag : full_bag;
+  }
+
+  /**
+   * remove the tile placed since the last move from the bag
+   */
+  void track(const board &before) {
+    board::board_t diff = before.raw() ^ last_.raw();
+    if (last_.raw() == 0 || diff == 0)
+      return;
+    unsigned pos = __builtin_ctzll(diff) >> 2;
+    bag_ = draw(bag_, before(pos));
+  }
+
+  /**
+   * the expected value of an afterstate after sliding 'op', over the
+   * placements of rndenv followed by 'depth' moves
+   */
+  float expect(const board &after, unsigned op, unsigned bag, unsigned depth) {
+    float sum = 0;
+    size_t n = 0;
+    for (unsigned cells = after.empty() & board::edge(op); cells;
+         cells &= cells - 1) {
+      unsigned pos = __builtin_ctz(cells);
+      for (board::tile_t tile = 1; tile <= 3; tile++) {
+        if (!(bag & (1u << (tile - 1))))
+          continue;
+        board before(after);
+        before.place(pos, tile);
+        sum += search(before, draw(bag, tile), depth);
+        n++;
+      }
+    }
+    return n ? sum / n : 0;
+  }
+
+  /**
+   * the value of the best move of a state with 'depth' moves left, where the
+   * last move is evaluated by the network, or 0 if there is no legal move
+   */
+  float search(const board &before, unsigned bag, unsigned depth) {
+    uint32_t tag = depth << 3 | bag;
+    entry &e = table_[hash(before.raw(), tag)];
+    if (e.key == before.raw() && e.tag == tag)
+      return e.value;
+    const board::moves moves = before.slides();
+    const board *after = moves.after;
+    const board::reward_t *reward = moves.reward;
+    float value[4], best = 0;
+    if (depth == 1 && moves.legal) {
+      estimate(after, value, 4);
+    } else {
+      for (unsigned op = 0; op < 4; op++)
+        value[op] = moves.legal & (1u << op)
+                        ? expect(after[op], op, bag, depth - 1)
+                        : 0;
+    }
+    for (unsigned op = 0, first = 1; op < 4; op++) {
+      if (!(moves.legal & (1u << op)))
+        continue;
+      best = first ? reward[op] + value[op]
+                   : std::max(best, reward[op] + value[op]);
+      first = 0;
+    }
+    e = {before.raw(), tag, best};
+    return best;
+  }
+
+  size_t hash(board::board_t key, uint32_t tag) const {
+    key ^= uint64_t(tag) * 0xff51afd7ed558ccdull;
+    return (key * 0x9e3779b97f4a7c15ull) >> (64 - bits_);
+  }
+
+  void init_search() {
+    depth_ = std::max(int(meta["depth"]), 1);
+    bits_ = std::min(std::max(int(meta["tt"]), 1), 32);
+    if (depth_ > 1)
+      table_.assign(size_t(1) << bits_, entry{});
+  }
+
 private:
   struct state {
     board before, after;
@@ -192,15 +668,37 @@ private:
     float reward, value;
   };
   std::vector<state> path_;
+
+  /**
+   * the transposition table, always replacing
+   * the tag of an empty entry is 0, which no bag matches
+   */
+  struct entry {
+    board::board_t key;
+    uint32_t tag;
+    float value;
+  };
+  std::vector<entry> table_;
+  unsigned depth_, bits_;
+
+  board last_;
+  unsigned bag_ = full_bag;
 };
 
 template <class _IntType, size_t _Size> class bag_int_distribution {
 public:
-  bag_int_distribution() { std::iota(std::begin(bag_), std::end(bag_), 1); }
-  void reset() { index_ = _Size; }
-  _IntType operator()(std::default_random_engine engine) {
+  bag_int_distribution() { reset(); }
+  /**
+   * refill the bag in order, so that the next draws depend on the engine only
+   */
+  void reset() {
+    std::iota(std::begin(bag_), std::end(bag_), 1);
+    index_ = _Size;
+  }
+  _IntType operator()(xoshiro256 &engine) {
     if (index_ == _Size) {
-      std::shuffle(std::begin(bag_), std::end(bag_), engine);
+      for (size_t i = _Size - 1; i > 0; i--)
+        std::swap(bag_[i], bag_[engine.below(i + 1)]);
       index_ = 0;
     }
     return bag_[index_++];
@@ -208,7 +706,7 @@ public:
 
 private:
   std::array<_IntType, _Size> bag_;
-  size_t index_ = _Size;
+  size_t index_;
 };
 
 /**
@@ -223,31 +721,36 @@ public:
   action init_action(size_t step) {
     if (step == 0) {
       popup.reset();
-      std::shuffle(std::begin(init_space), std::end(init_space), engine);
+      init_space = 0xffff;
     }
+    unsigned pos = select(init_space);
+    init_space &= ~(1u << pos);
     board::tile_t tile = popup(engine);
-    return action::place(init_space[step], tile);
+    return action::place(pos, tile);
   }
 
   virtual action take_action(const board &after, unsigned move_) {
-    auto &cur = space[move_];
-    std::shuffle(std::begin(cur), std::end(cur), engine);
-    for (unsigned pos : cur) {
-      if (after(pos) != 0)
-        continue;
-      board::tile_t tile = popup(engine);
-      return action::place(pos, tile);
-    }
-    return action();
+    unsigned cells = after.empty() & board::edge(move_);
+    if (cells == 0)
+      return action();
+    unsigned pos = select(cells);
+    board::tile_t tile = popup(engine);
+    return action::place(pos, tile);
   }
 
 private:
-  std::array<unsigned, 16> init_space{0u, 1u, 2u,  3u,  4u,  5u,  6u,  7u,
-                                      8u, 9u, 10u, 11u, 12u, 13u, 14u, 15u};
-  std::array<unsigned, 4> space[4]{{12u, 13u, 14u, 15u},
-                                   {0u, 4u, 8u, 12u},
-                                   {0u, 1u, 2u, 3u},
-                                   {3u, 7u, 11u, 15u}};
+  /**
+   * a uniformly random cell of a nonzero mask of cells
+   */
+  unsigned select(unsigned cells) {
+    for (unsigned k = engine.below(__builtin_popcount(cells)); k; k--)
+      cells &= cells - 1;
+    return __builtin_ctz(cells);
+  }
+
+private:
+  // the cells left for the initial tiles
+  unsigned init_space = 0xffff;
   bag_int_distribution<board::tile_t, 3> popup;
 };
 
@@ -263,9 +766,9 @@ public:
 
   virtual action take_action(const board &before, unsigned) {
     std::shuffle(std::begin(opcode), std::end(opcode), engine);
+    unsigned legal = before.slides().legal;
     for (unsigned op : opcode) {
-      board::reward_t reward = board(before).slide(op);
-      if (reward != -1)
+      if (legal & (1u << op))
         return action::slide(op);
     }
     return action();
@@ -285,14 +788,11 @@ public:
       : random_agent("name=greedy role=player " + args) {}
 
   virtual action take_action(const board &before, unsigned = 4) {
-    board::reward_t reward[4] = {
-        board(before).slide(0u), board(before).slide(1u),
-        board(before).slide(2u), board(before).slide(3u)};
-    board::reward_t *max_reward = std::max_element(reward, reward + 4);
-    if (*max_reward != -1) {
-      return action::slide(max_reward - reward);
-    }
-    return action();
+    const board::moves moves = before.slides();
+    if (!moves.legal)
+      return action();
+    const board::reward_t *reward = moves.reward;
+    return action::slide(std::max_element(reward, reward + 4) - reward);
   }
 };
 
@@ -344,10 +844,11 @@ public:
       : random_agent("name=deep_greedy role=player " + args) {}
 
   virtual action take_action(const board &before, unsigned) {
+    const board::moves moves = before.slides();
     board::reward_t reward[4] = {}, rew;
     for (size_t op = 0; op < 3; ++op) {
-      board cur(before);
-      if ((reward[op] = cur.slide(op)) == -1)
+      board cur(moves.after[op]);
+      if ((reward[op] = moves.reward[op]) == -1)
         continue;
       env.reset();
       unsigned move_ = op;
@@ -0,0 +1,755 @@
+#include "agent.h"
+#include "board.h"
+#include "cpu.h"
+#include "episode.h"
+#include "pattern.h"
+#include "rng.h"
+#include "statistic.h"
+#include "timer.h"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * microbenchmarks of the engine hot paths
+ *
+ * the corpora, all of fixed seeds, are the boards of random tiles, and the
+ * mid-game and late-game boards, i.e., the middle and the last third of the
+ * games played by tdl_agent with '--play' against rndenv
+ * without weights to load, tdl_agent plays greedily
+ *
+ * usage:
+ *   ./bench [--size=65536] [--round=64] [--play='load=weights.bin']
+ *           [--save=bench.tsv]
+ *
+ * each benchmark reports the time per operation, the operations per second,
+ * and the cache misses per operation and per cache reference if the hardware
+ * counters are available (not in most VMs)
+ * '--save' writes them as tab-separated lines in a fixed order, to be diffed
+ * between builds
+ */
+
+static volatile size_t sink;
+
+/**
+ * the cache references and misses of this thread, from perf_event_open
+ */
+class cache_counter {
+public:
+  cache_counter()
+      : references_(open(PERF_COUNT_HW_CACHE_REFERENCES)),
+        misses_(open(PERF_COUNT_HW_CACHE_MISSES)) {}
+  ~cache_counter() {
+    if (references_ >= 0)
+      ::close(references_);
+    if (misses_ >= 0)
+      ::close(misses_);
+  }
+
+  bool enabled() const { return references_ >= 0 && misses_ >= 0; }
+  void start() {
+    for (int fd : {references_, misses_}) {
+      ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  /**
+   * stop and return the references and the misses since start
+   */
+  std::pair<uint64_t, uint64_t> stop() {
+    uint64_t count[2] = {};
+    for (int i : {0, 1}) {
+      int fd = i ? misses_ : references_;
+      ::ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (::read(fd, &count[i], sizeof(count[i])) != sizeof(count[i]))
+        count[i] = 0;
+    }
+    return {count[0], count[1]};
+  }
+
+private:
+  static int open(uint64_t config) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return ::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+  int references_, misses_;
+};
+
+static cache_counter counter;
+
+/**
+ * the results in the order of the benchmarks, where 'misses' and 'rate' are
+ * negative if the counters are not available
+ */
+struct record {
+  std::string name;
+  double ns, misses, rate;
+};
+static std::vector<record> records;
+
+double report(const std::string &name, double ns, double misses = -1,
+              double rate = -1) {
+  std::ios ff(nullptr);
+  ff.copyfmt(std::cout);
+  std::cout << std::left << std::setw(32) << name << std::right << std::fixed
+            << std::setprecision(2) << std::setw(10) << ns << " ns/op"
+            << std::setprecision(0) << std::setw(12) << (1e9 / ns) << " ops/s";
+  if (misses >= 0) {
+    std::cout << std::setprecision(2) << std::setw(8) << misses << " miss/op"
+              << std::setw(8) << (rate * 100) << "% miss";
+  }
+  std::cout << std::endl;
+  std::cout.copyfmt(ff);
+  records.push_back({name, ns, misses, rate});
+  return ns;
+}
+
+void save(const std::string &path) {
+  std::ofstream out(path, std::ios::out | std::ios::trunc);
+  out << "# name\tns/op\tops/s\tmisses/op\tmiss rate" << std::endl;
+  out << std::fixed;
+  for (const record &r : records) {
+    out << r.name << '\t' << std::setprecision(2) << r.ns << '\t'
+        << std::setprecision(0) << (1e9 / r.ns) << '\t';
+    if (r.misses >= 0)
+      out << std::setprecision(4) << r.misses << '\t' << r.rate << std::endl;
+    else
+      out << "-\t-" << std::endl;
+  }
+}
+
+/**
+ * measure 'func', which runs 'ops' operations, and print the average time
+ * and the cache misses per operation
+ */
+template <class func>
+double measure_ops(const std::string &name, size_t ops, func f) {
+  if (counter.enabled())
+    counter.start();
+  auto start = std::chrono::steady_clock::now();
+  sink = f();
+  auto stop = std::chrono::steady_clock::now();
+  double ns =
+      std::chrono::duration<double, std::nano>(stop - start).count() / ops;
+  if (!counter.enabled())
+    return report(name, ns);
+  auto cache = counter.stop();
+  return report(name, ns, double(cache.second) / ops,
+                cache.first ? double(cache.second) / cache.first : 0);
+}
+
+/**
+ * measure 'func' on each item of 'corpus', e.g., boards, for 'round' times
+ */
+template <class corpus_t, class func>
+double measure(const std::string &name, const corpus_t &corpus, size_t round,
+               func f) {
+  return measure_ops(name, corpus.size() * round, [&]() {
+    size_t result = 0;
+    for (size_t r = 0; r < round; r++) {
+      for (const auto &item : corpus)
+        result += f(item);
+    }
+    return result;
+  });
+}
+
+/**
+ * the index extraction before the compile-time engine, i.e., look up the
+ * isomorphic cells nibble by nibble
+ */
+template <board::tile_t... cells> struct reference_index {
+  reference_index() {
+    for (size_t i = 0; i < 8; i++) {
+      board idx = board(0xfedcba9876543210ull).isomorphism(i);
+      for (board::tile_t t : {cells...})
+        isomorphism[i].push_back(idx(t));
+    }
+  }
+  size_t operator()(const board &b) const {
+    size_t result = 0;
+    for (const auto &p : isomorphism) {
+      size_t index = 0;
+      for (size_t i = 0; i < p.size(); ++i)
+        index |= b(p[i]) << (i << 2);
+      result += index;
+    }
+    return result;
+  }
+  std::array<std::vector<board::tile_t>, 8> isomorphism;
+};
+
+template <board::tile_t... cells>
+void bench_indexof(const std::vector<board> &corpus, size_t round) {
+  using pattern = tuple_pattern<cells...>;
+  std::string name = "indexof";
+  char sep = ' ';
+  for (board::tile_t t : {cells...}) {
+    name += sep + std::to_string(t);
+    sep = ',';
+  }
+  reference_index<cells...> reference;
+  double ref = measure(name + " (reference)", corpus, round, reference);
+  auto sum = [](const std::array<size_t, 8> &index) {
+    return std::accumulate(index.begin(), index.end(), size_t(0));
+  };
+  double shf = measure(name + " (shift)", corpus, round, [&](const board &b) {
+    return sum(pattern::indexof_shift(symmetry(b)));
+  });
+  std::cout << "  speedup of shift: " << (ref / shf) << "x" << std::endl;
+  if (cpu::bmi2()) {
+    double pxt = measure(name + " (pext)", corpus, round, [&](const board &b) {
+      return sum(pattern::indexof_pext(symmetry(b)));
+    });
+    std::cout << "  speedup of pext: " << (ref / pxt) << "x" << std::endl;
+  }
+}
+
+/**
+ * the indexes of all the tdl_agent patterns, with the board expanded once for
+ * each pattern or once for all
+ */
+void bench_symmetry(const std::vector<board> &corpus, size_t round) {
+  auto sum = [](const std::array<size_t, 8> &index) {
+    return std::accumulate(index.begin(), index.end(), size_t(0));
+  };
+  using p0 = tuple_pattern<0, 1, 2, 3, 4, 5>;
+  using p1 = tuple_pattern<4, 5, 6, 7, 8, 9>;
+  using p2 = tuple_pattern<0, 1, 2, 4, 5, 6>;
+  using p3 = tuple_pattern<4, 5, 6, 8, 9, 10>;
+  double each =
+      measure("indexof x4 (expand each)", corpus, round, [&](const board &b) {
+        return sum(p0::indexof(symmetry(b))) + sum(p1::indexof(symmetry(b))) +
+               sum(p2::indexof(symmetry(b))) + sum(p3::indexof(symmetry(b)));
+      });
+  double once =
+      measure("indexof x4 (expand once)", corpus, round, [&](const board &b) {
+        const symmetry iso(b);
+        return sum(p0::indexof(iso)) + sum(p1::indexof(iso)) +
+               sum(p2::indexof(iso)) + sum(p3::indexof(iso));
+      });
+  std::cout << "  speedup of expand once: " << (each / once) << "x"
+            << std::endl;
+}
+
+/**
+ * the slides before the direction tables, i.e., permute the board around
+ * slide_left
+ */
+board::reward_t reference_slide(board &b, unsigned op) {
+  board::reward_t reward;
+  switch (op & 0b11) {
+  case 0:
+    b.transpose();
+    reward = b.slide(3);
+    b.mirror();
+    b.transpose();
+    b.flip();
+    return reward;
+  case 1:
+    b.mirror();
+    reward = b.slide(3);
+    b.mirror();
+    return reward;
+  case 2:
+    b.transpose();
+    b.mirror();
+    reward = b.slide(3);
+    b.transpose();
+    b.flip();
+    return reward;
+  default:
+    return b.slide(3);
+  }
+}
+
+/**
+ * the games played by tdl_agent against rndenv, and the boards before each
+ * move, split into the mid-game and late-game ones
+ */
+struct games {
+  std::vector<episode> episodes;
+  std::vector<board> mid, late;
+};
+
+games play(size_t size, const std::string &args) {
+  games g;
+  tdl_agent play("alpha=0 " + args);
+  rndenv evil("seed=0");
+  while (g.mid.size() < size || g.late.size() < size) {
+    play.open_episode("~:" + evil.name());
+    evil.open_episode(play.name() + ":~");
+    episode game;
+    game.open_episode(play.name() + ":" + evil.name());
+    for (size_t i = 0; i < 9; i++) {
+      game.take_turns(play, evil);
+      game.apply_action(evil.init_action(i));
+    }
+    std::vector<board> path;
+    for (unsigned move = 0;;) {
+      agent &who = game.take_turns(play, evil);
+      if (&who == &play) {
+        if (!game.state().slides().legal)
+          break;
+        path.push_back(game.state());
+      }
+      action a = who.take_action(game.state(), move);
+      move = a.event() & 0b11;
+      if (!game.apply_action(a))
+        break;
+    }
+    agent &win = game.last_turns(play, evil);
+    game.close_episode(win.name());
+    play.update_episode();
+    play.close_episode(win.name());
+    evil.close_episode(win.name());
+    g.episodes.push_back(std::move(game));
+    size_t third = path.size() / 3;
+    g.mid.insert(g.mid.end(), path.begin() + third, path.end() - third);
+    g.late.insert(g.late.end(), path.end() - third, path.end());
+  }
+  g.mid.resize(size);
+  g.late.resize(size);
+  return g;
+}
+
+void bench_slide(const std::vector<board> &corpus, size_t round,
+                 const std::string &kind) {
+  // both should give identical results
+  size_t mismatch = 0;
+  for (const board &b : corpus) {
+    for (unsigned op = 0; op < 4; op++) {
+      board ref(b), cur(b);
+      mismatch += reference_slide(ref, op) != cur.slide(op) || ref != cur;
+    }
+  }
+  std::cout << "slide " << kind << " mismatches: " << mismatch << std::endl;
+
+  for (unsigned op = 0; op < 4; op++) {
+    std::string name = "slide " + kind + " " + "URDL"[op];
+    double ref = measure(name + " (reference)", corpus, round,
+                         [&](const board &b) {
+                           board after(b);
+                           return reference_slide(after, op) + after.raw();
+                         });
+    double cur =
+        measure(name + " (lookup)", corpus, round, [&](const board &b) {
+          board after(b);
+          return after.slide(op) + after.raw();
+        });
+    std::cout << "  speedup of lookup: " << (ref / cur) << "x" << std::endl;
+  }
+}
+
+/**
+ * slide the whole corpus in each direction, one board at a time, all four
+ * directions of a board at once, or in one batch
+ */
+void bench_slide_batch(const std::vector<board> &corpus, size_t round,
+                       const std::string &kind) {
+  std::vector<board::board_t> before, after(corpus.size());
+  std::vector<board::reward_t> reward(corpus.size());
+  for (const board &b : corpus)
+    before.push_back(b.raw());
+
+  // all should give identical results
+  size_t mismatch = 0;
+  for (unsigned op = 0; op < 4; op++) {
+    board::slide(before.data(), op, after.data(), reward.data(), before.size());
+    for (size_t i = 0; i < before.size(); i++) {
+      board b(before[i]);
+      board::moves moves = b.slides();
+      mismatch += b.slide(op) != reward[i] || b.raw() != after[i];
+      mismatch += moves.reward[op] != reward[i] ||
+                  moves.after[op].raw() != after[i] ||
+                  bool(moves.legal & (1u << op)) != (reward[i] != -1);
+    }
+  }
+  std::cout << "slide " << kind << " batch mismatches: " << mismatch
+            << std::endl;
+
+  std::string name = "slide " + kind + " x4";
+  double one = measure(name + " (one by one)", corpus, round,
+                       [&](const board &b) {
+                         size_t result = 0;
+                         for (unsigned op = 0; op < 4; op++) {
+                           board after(b);
+                           result += after.slide(op) + after.raw();
+                         }
+                         return result;
+                       });
+  double all = measure(name + " (slides)", corpus, round, [&](const board &b) {
+    board::moves moves = b.slides();
+    size_t result = moves.legal;
+    for (unsigned op = 0; op < 4; op++)
+      result += moves.reward[op] + moves.after[op].raw();
+    return result;
+  });
+  std::cout << "  speedup of slides: " << (one / all) << "x" << std::endl;
+  double batch =
+      measure_ops(name + " (batch)", corpus.size() * round, [&]() {
+        size_t result = 0;
+        for (size_t r = 0; r < round; r++) {
+          for (unsigned op = 0; op < 4; op++) {
+            board::slide(before.data(), op, after.data(), reward.data(),
+                         before.size());
+            result += after.back() + reward.back();
+          }
+        }
+        return result;
+      });
+  std::cout << "  speedup of batch: " << (one / batch) << "x" << std::endl;
+}
+
+/**
+ * the placement before the empty-cell mask, i.e., shuffle the edge and probe
+ * the cells one by one
+ */
+struct reference_place {
+  unsigned operator()(const board &after, unsigned op) {
+    auto &cur = space[op];
+    std::shuffle(std::begin(cur), std::end(cur), engine);
+    for (unsigned pos : cur) {
+      if (after(pos) == 0)
+        return pos;
+    }
+    return -1u;
+  }
+  std::default_random_engine engine;
+  std::array<unsigned, 4> space[4]{{12u, 13u, 14u, 15u},
+                                   {0u, 4u, 8u, 12u},
+                                   {0u, 1u, 2u, 3u},
+                                   {3u, 7u, 11u, 15u}};
+};
+
+void bench_place(const std::vector<board> &corpus, size_t round,
+                 const std::string &kind) {
+  // the afterstates of a legal slide, so that the edge has an empty cell
+  std::vector<board> after;
+  std::vector<unsigned> op;
+  for (const board &b : corpus) {
+    board::moves moves = b.slides();
+    for (unsigned i = 0; i < 4; i++) {
+      if (moves.legal & (1u << i)) {
+        after.push_back(moves.after[i]);
+        op.push_back(i);
+        break;
+      }
+    }
+  }
+  size_t i = 0;
+  reference_place reference;
+  std::string name = "place " + kind;
+  double ref = measure(name + " (reference)", after, round,
+                       [&](const board &b) {
+                         return reference(b, op[i++ % op.size()]);
+                       });
+  rndenv evil;
+  i = 0;
+  double cur = measure(name + " (mask)", after, round, [&](const board &b) {
+    return action::place(evil.take_action(b, op[i++ % op.size()])).position();
+  });
+  std::cout << "  speedup of mask: " << (ref / cur) << "x" << std::endl;
+}
+
+/**
+ * the draws of rndenv, i.e., a cell out of a few empty cells and a tile of the
+ * bag, before and after xoshiro256
+ */
+void bench_rng(size_t size, size_t round) {
+  size_t ops = size * round;
+  std::default_random_engine reference;
+  double ref = measure_ops("rng below (reference)", ops, [&]() {
+    size_t result = 0;
+    for (size_t i = 0; i < ops; i++) {
+      std::uniform_int_distribution<unsigned> nth(0, i & 3);
+      result += nth(reference);
+    }
+    return result;
+  });
+  xoshiro256 engine;
+  double cur = measure_ops("rng below (xoshiro256)", ops, [&]() {
+    size_t result = 0;
+    for (size_t i = 0; i < ops; i++)
+      result += engine.below((i & 3) + 1);
+    return result;
+  });
+  std::cout << "  speedup of below: " << (ref / cur) << "x" << std::endl;
+  std::array<unsigned, 3> bag{{1, 2, 3}};
+  ref = measure_ops("rng bag (reference)", ops, [&]() {
+    size_t result = 0;
+    for (size_t i = 0; i < ops; i += 3) {
+      std::shuffle(std::begin(bag), std::end(bag), reference);
+      result += bag[0] + bag[1] * 3 + bag[2] * 9;
+    }
+    return result;
+  });
+  bag_int_distribution<unsigned, 3> popup;
+  cur = measure_ops("rng bag (xoshiro256)", ops, [&]() {
+    size_t result = 0;
+    for (size_t i = 0; i < ops; i++)
+      result += popup(engine);
+    return result;
+  });
+  std::cout << "  speedup of bag: " << (ref / cur) << "x" << std::endl;
+}
+
+/**
+ * the clocks of the move times, two readings per move
+ */
+void bench_timer(size_t size, size_t round) {
+  double ref = 0;
+  for (const char *mode : {"system", "steady", "tsc", "off"}) {
+    timer::select(mode);
+    double cur = measure_ops("timer " + std::string(mode), size * round, [&]() {
+      int64_t result = 0;
+      for (size_t i = 0; i < size * round; i++)
+        result += timer::now();
+      return result;
+    });
+    if (ref == 0)
+      ref = cur;
+    else
+      std::cout << "  speedup of " << mode << ": " << (ref / cur) << "x"
+                << std::endl;
+  }
+  timer::select(timer::steady);
+}
+
+/**
+ * expose the evaluation paths of the n-tuple network
+ */
+template <weight_table::storage_t s> struct network : public tdl_agent {
+  network() : tdl_agent("alpha=0 weights=" + weight_table::name(s)) {}
+  using tdl_agent::estimate;
+  using tdl_agent::update;
+  float estimate_scalar(const board &b) const {
+    return tdl_agent::estimate_scalar<s>(symmetry(b));
+  }
+  float estimate_avx2(const board &b) const {
+    return tdl_agent::estimate_avx2<s>(symmetry(b),
+                                       std::make_index_sequence<4>());
+  }
+  void estimate_avx512(const board *b, float *value) const {
+    const symmetry iso[] = {symmetry(b[0]), symmetry(b[1])};
+    tdl_agent::estimate_avx512<s>(iso, value, std::make_index_sequence<4>());
+  }
+};
+
+template <weight_table::storage_t s>
+void bench_estimate(const std::vector<board> &corpus, size_t round,
+                    const std::string &kind) {
+  network<s> net;
+  std::string name = " " + weight_table::name(s) + " " + kind;
+  std::mt19937_64 engine(0);
+  std::uniform_real_distribution<float> value(-100, 100);
+  for (const board &b : corpus)
+    net.update(b, value(engine));
+
+  // all the paths should give identical results
+  size_t mismatch = 0;
+  for (size_t i = 0; i + 2 <= corpus.size(); i += 2) {
+    float scalar[2] = {net.estimate_scalar(corpus[i]),
+                       net.estimate_scalar(corpus[i + 1])};
+    float vector[2];
+    if (cpu::avx2()) {
+      vector[0] = net.estimate_avx2(corpus[i]);
+      mismatch += std::memcmp(&vector[0], &scalar[0], sizeof(float)) != 0;
+    }
+    if (cpu::avx512f()) {
+      net.estimate_avx512(&corpus[i], vector);
+      mismatch += std::memcmp(vector, scalar, sizeof(vector)) != 0;
+    }
+  }
+  std::cout << "estimate" << name << " mismatches: " << mismatch << std::endl;
+
+  measure("estimate" + name + " (scalar)", corpus, round,
+          [&](const board &b) { return net.estimate_scalar(b) > 0; });
+  if (cpu::avx2()) {
+    measure("estimate" + name + " (avx2)", corpus, round,
+            [&](const board &b) { return net.estimate_avx2(b) > 0; });
+  }
+  if (cpu::avx512f()) {
+    measure("estimate" + name + " x2 (avx512)", corpus, round / 2,
+            [&](const board &b) {
+              float value[2];
+              net.estimate_avx512(&b, value);
+              return value[0] + value[1] > 0;
+            });
+  }
+  measure("estimate" + name + " x4 (dispatch)", corpus, round / 4,
+          [&](const board &b) {
+            board after[] = {b, b, b, b};
+            float value[4];
+            for (unsigned op = 0; op < 4; op++)
+              after[op].slide(op);
+            net.estimate(after, value, 4);
+            return value[0] + value[1] + value[2] + value[3] > 0;
+          });
+  // no-op updates, so that the weights stay the same
+  measure("update" + name, corpus, round,
+          [&](const board &b) { return net.update(b, 0) > 0; });
+}
+
+/**
+ * write and read the episodes in the text format of statistic
+ */
+void bench_episode(const std::vector<episode> &episodes, size_t round) {
+  std::vector<std::string> text;
+  size_t moves = 0;
+  for (const episode &ep : episodes) {
+    std::stringstream ss;
+    ss << ep;
+    text.push_back(ss.str());
+    moves += ep.step();
+  }
+  std::cout << "episode moves: " << (moves / episodes.size()) << " on average"
+            << std::endl;
+  measure("episode write", episodes, round, [&](const episode &ep) {
+    std::stringstream ss;
+    ss << ep;
+    return ss.tellp();
+  });
+  measure("episode read", text, round, [&](const std::string &line) {
+    std::stringstream ss(line);
+    episode ep;
+    ss >> ep;
+    return ep.step();
+  });
+
+  // each record by a log of its own, i.e., with the tags written inline
+  std::vector<std::string> binary;
+  size_t bytes = 0, chars = 0;
+  for (size_t i = 0; i < episodes.size(); i++) {
+    std::stringstream ss;
+    episode_log().write(ss, episodes[i]);
+    binary.push_back(ss.str());
+    bytes += binary.back().size();
+    chars += text[i].size();
+  }
+  std::cout << "episode log: " << (bytes / episodes.size()) << " bytes ("
+            << (chars / episodes.size()) << " chars of text) on average"
+            << std::endl;
+  measure("episode write (log)", episodes, round, [&](const episode &ep) {
+    std::stringstream ss;
+    episode_log().write(ss, ep);
+    return ss.tellp();
+  });
+  measure("episode read (log)", binary, round, [&](const std::string &rec) {
+    std::stringstream ss(rec);
+    episode ep;
+    episode_log().read(ss, ep);
+    return ep.step();
+  });
+}
+
+/**
+ * load a file of the episodes by operator>> and by statistic::load
+ */
+void bench_load(const std::vector<episode> &episodes, size_t round) {
+  std::string path = "bench.load.txt";
+  {
+    std::ofstream out(path, std::ios::out | std::ios::trunc);
+    for (size_t r = 0; r < round; r++) {
+      for (const episode &ep : episodes)
+        out << ep << std::endl;
+    }
+  }
+  size_t ops = episodes.size() * round;
+  double ref = measure_ops("load (stream)", ops, [&]() {
+    statistic stat(ops);
+    std::ifstream in(path, std::ios::in);
+    in >> stat;
+    return stat.size();
+  });
+  std::vector<size_t> threads = {1};
+  if (std::thread::hardware_concurrency() > 1)
+    threads.push_back(std::thread::hardware_concurrency());
+  for (size_t threads : threads) {
+    double cur = measure_ops("load (" + std::to_string(threads) + " threads)",
+                             ops, [&]() {
+                               statistic stat(ops);
+                               stat.load(path, threads);
+                               return stat.size();
+                             });
+    std::cout << "  speedup of load: " << (ref / cur) << "x" << std::endl;
+  }
+  std::remove(path.c_str());
+}
+
+int main(int argc, const char *argv[]) {
+  size_t size = 65536, round = 64;
+  std::string play_args, save_path;
+  for (int i = 1; i < argc; i++) {
+    std::string para(argv[i]);
+    if (para.find("--size=") == 0) {
+      size = std::stoull(para.substr(para.find('=') + 1));
+    } else if (para.find("--round=") == 0) {
+      round = std::stoull(para.substr(para.find('=') + 1));
+    } else if (para.find("--play=") == 0) {
+      play_args = para.substr(para.find('=') + 1);
+    } else if (para.find("--save=") == 0) {
+      save_path = para.substr(para.find('=') + 1);
+    }
+  }
+  if (!counter.enabled())
+    std::cout << "cache counters: not available" << std::endl;
+
+  // boards of random tiles with a fixed seed
+  std::vector<board> corpus;
+  std::mt19937_64 engine(0);
+  std::uniform_int_distribution<int> tile(0, 14);
+  for (size_t i = 0; i < size; i++) {
+    board b;
+    for (size_t pos = 0; pos < 16; pos++)
+      b.set(pos, tile(engine));
+    corpus.push_back(b);
+  }
+  const games g = play(size, play_args);
+
+  bench_slide(corpus, round, "random");
+  bench_slide(g.mid, round, "mid");
+  bench_slide(g.late, round, "late");
+  bench_slide_batch(g.mid, round, "mid");
+  bench_slide_batch(g.late, round, "late");
+  bench_place(g.mid, round, "mid");
+  bench_place(g.late, round, "late");
+  bench_rng(size, round);
+  bench_timer(size, round);
+  bench_indexof<0, 1, 2, 3, 4, 5>(corpus, round);
+  bench_indexof<0, 1, 2, 4, 5, 6>(corpus, round);
+  bench_indexof<0, 2, 5, 7, 8, 13>(corpus, round);
+  bench_symmetry(corpus, round);
+  bench_estimate<weight_table::fp32>(g.mid, round, "mid");
+  bench_estimate<weight_table::fp32>(g.late, round, "late");
+  bench_estimate<weight_table::fp16>(g.mid, round, "mid");
+  bench_estimate<weight_table::fp16>(g.late, round, "late");
+  bench_estimate<weight_table::q16>(g.mid, round, "mid");
+  bench_estimate<weight_table::q16>(g.late, round, "late");
+  bench_episode(g.episodes, round);
+  bench_load(g.episodes, round);
+
+  if (!save_path.empty())
+    save(save_path);
+  return 0;
+}
@@ -1,7 +1,12 @@
 #pragma once
+#include "cpu.h"
 #include <cassert>
+#include <cstdint>
 #include <iomanip>
 #include <iostream>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 class board {
 public:
@@ -10,16 +15,19 @@ public:
   using tile_t = uint8_t;
   using reward_t = int;
 
-  explicit board(board_t rhs = 0u) : raw_(rhs) {}
-  board(const board &) = default;
+  constexpr explicit board(board_t rhs = 0u) : raw_(rhs) {}
+  constexpr board(const board &) = default;
   board &operator=(const board &) = default;
   ~board() = default;
   bool operator==(const board &rhs) const { return raw_ == rhs.raw_; }
   bool operator!=(const board &rhs) const { return !(*this == rhs); }
 
 public:
+  constexpr board_t raw() const { return raw_; }
   row_t operator[](size_t i) const { return (raw_ >> (i << 4u)) & 0xffff; }
-  tile_t operator()(size_t i) const { return (raw_ >> (i << 2u)) & 0x0f; }
+  constexpr tile_t operator()(size_t i) const {
+    return (raw_ >> (i << 2u)) & 0x0f;
+  }
   void set(size_t i, tile_t e) {
     raw_ =
         (raw_ & ~(0x0full << (i << 2u))) | (board_t(e & 0x0full) << (i << 2u));
@@ -31,6 +39,29 @@ public:
     return 0;
   }
 
+  /**
+   * the empty cells as a 16-bit mask, i.e., bit i is set if cell i is empty
+   * fold each nibble into its lowest bit, then pack the bits by halves
+   */
+  row_t empty() const {
+    board_t x = raw_ | (raw_ >> 1);
+    x = ~(x | (x >> 2)) & 0x1111111111111111ull;
+    x = (x | (x >> 3)) & 0x0303030303030303ull;
+    x = (x | (x >> 6)) & 0x000f000f000f000full;
+    x = (x | (x >> 12)) & 0x000000ff000000ffull;
+    return (x | (x >> 24)) & 0xffff;
+  }
+
+  /**
+   * the cells at the edge opposite to slide opcode, where a new tile enters
+   */
+  static constexpr row_t edge(unsigned opcode) {
+    return (opcode & 0b11) == 0   ? 0xf000
+           : (opcode & 0b11) == 1 ? 0x1111
+           : (opcode & 0b11) == 2 ? 0x000f
+                                  : 0x8888;
+  }
+
   tile_t max_tile() const {
     tile_t ret = 0;
     for (size_t i = 0; i < 16; ++i) {
@@ -57,7 +88,51 @@ public:
     return -1;
   }
 
-  void rotate_clockwise(size_t r) {
+  /**
+   * all four slides in one pass, see moves
+   * the rows are looked up once for left and right, and the columns are
+   * gathered by one transpose and looked up once for up and down
+   */
+  struct moves;
+  moves slides() const;
+
+  /**
+   * slide n boards in the same direction at once
+   * the afterstates and the rewards are stored in separate arrays, where the
+   * reward of an illegal slide is -1 (and the afterstate is the board)
+   * the lookups of 4 boards are gathered at once with AVX2 if the CPU
+   * supports it, which gives the same results as slide
+   */
+  static void slide(const board_t *before, unsigned opcode, board_t *after,
+                    reward_t *reward, size_t n) {
+    const lookup &l = lookup::table();
+    unsigned op = opcode & 0b11;
+    const uint32_t *rows = (op == 1 || op == 2) ? l.right : l.left;
+    const board_t *columns = op == 0 ? l.up : op == 2 ? l.down : nullptr;
+    size_t i = 0;
+    if (cpu::avx2())
+      i = slide_avx2(before, rows, columns, after, reward, n);
+    for (; i < n; i++) {
+      board b(before[i]);
+      reward[i] = columns ? b.slide_columns(columns, rows) : b.slide_rows(rows);
+      after[i] = b.raw();
+    }
+  }
+
+  /**
+   * the i-th isomorphism (0 <= i < 8)
+   * rotate clockwise i times, with a horizontal reflection first if i >= 4
+   */
+  constexpr board isomorphism(size_t i) const {
+    board b(*this);
+    if (i >= 4) {
+      b.mirror();
+    }
+    b.rotate_clockwise(i);
+    return b;
+  }
+
+  constexpr void rotate_clockwise(size_t r) {
     switch ((r + 4) % 4) {
     default:
     case 0:
@@ -78,38 +153,120 @@ public:
   }
 
 private:
-  reward_t slide_left() {
+  /**
+   * slide each row by the direction table, so that every direction costs
+   * four lookups and ORs
+   * the columns are gathered as rows by one transpose, and put back by the
+   * pre-shifted column masks of the tables
+   */
+  reward_t slide_left() { return slide_rows(lookup::table().left); }
+  reward_t slide_right() { return slide_rows(lookup::table().right); }
+  reward_t slide_up() {
+    return slide_columns(lookup::table().up, lookup::table().left);
+  }
+  reward_t slide_down() {
+    return slide_columns(lookup::table().down, lookup::table().right);
+  }
+
+  reward_t slide_rows(const uint32_t *rows) {
+    board_t cur = 0u, prev = raw_;
+    reward_t score = 0;
+    for (size_t i = 0; i < 4; i++) {
+      uint32_t e = rows[operator[](i)];
+      cur |= board_t(e & 0xffff) << (i << 4);
+      score += e >> 16;
+    }
+    raw_ = cur;
+    return (cur != prev) ? score : -1;
+  }
+
+  reward_t slide_columns(const board_t *columns, const uint32_t *rows) {
+    board t(*this);
+    t.transpose();
     board_t cur = 0u, prev = raw_;
     reward_t score = 0;
-    score += lookup::find(operator[](0)).slide_left(cur, 0);
-    score += lookup::find(operator[](1)).slide_left(cur, 1);
-    score += lookup::find(operator[](2)).slide_left(cur, 2);
-    score += lookup::find(operator[](3)).slide_left(cur, 3);
+    for (size_t i = 0; i < 4; i++) {
+      cur |= columns[t[i]] << (i << 2);
+      score += rows[t[i]] >> 16;
+    }
     raw_ = cur;
     return (cur != prev) ? score : -1;
   }
-  reward_t slide_right() {
-    mirror();
-    reward_t score = slide_left();
-    mirror();
-    return score;
+
+#if defined(__x86_64__) || defined(__i386__)
+  /**
+   * slide_rows or slide_columns on 4 boards per step, and return the number
+   * of boards done
+   */
+  __attribute__((target("avx2"))) static size_t
+  slide_avx2(const board_t *before, const uint32_t *rows,
+             const board_t *columns, board_t *after, reward_t *reward,
+             size_t n) {
+    const __m256i row = _mm256_set1_epi64x(0xffff);
+    const __m256i low = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    const __m128i half = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1,
+                                       -1, -1, -1, -1, -1);
+    const int *row_table = reinterpret_cast<const int *>(rows);
+    const long long *column_table =
+        reinterpret_cast<const long long *>(columns);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      __m256i prev = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i *>(before + i));
+      __m256i src = columns ? transpose_avx2(prev) : prev;
+      __m256i cur = _mm256_setzero_si256();
+      __m128i score = _mm_setzero_si128();
+      for (int k = 0; k < 4; k++) {
+        __m256i index = _mm256_and_si256(_mm256_srli_epi64(src, k << 4), row);
+        __m128i e = _mm256_i64gather_epi32(row_table, index, 4);
+        score = _mm_add_epi32(score, _mm_srli_epi32(e, 16));
+        __m256i line;
+        if (columns) {
+          line = _mm256_i64gather_epi64(column_table, index, 8);
+          line = _mm256_slli_epi64(line, k << 2);
+        } else {
+          line = _mm256_cvtepu16_epi64(_mm_shuffle_epi8(e, half));
+          line = _mm256_slli_epi64(line, k << 4);
+        }
+        cur = _mm256_or_si256(cur, line);
+      }
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(after + i), cur);
+      // the reward of an unchanged board is -1
+      __m256i same = _mm256_permutevar8x32_epi32(
+          _mm256_cmpeq_epi64(cur, prev), low);
+      score = _mm_or_si128(score, _mm256_castsi256_si128(same));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(reward + i), score);
+    }
+    return i;
   }
-  reward_t slide_up() {
-    transpose();
-    reward_t score = slide_left();
-    mirror();
-    transpose();
-    flip();
-    return score;
+
+  /**
+   * transpose of 4 boards, see transpose
+   */
+  __attribute__((target("avx2"))) static __m256i transpose_avx2(__m256i x) {
+    auto mask = [](board_t m) { return _mm256_set1_epi64x(m); };
+    x = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_and_si256(x, mask(0xf0f00f0ff0f00f0full)),
+            _mm256_slli_epi64(_mm256_and_si256(x, mask(0x0000f0f00000f0f0ull)),
+                              12)),
+        _mm256_srli_epi64(_mm256_and_si256(x, mask(0x0f0f00000f0f0000ull)),
+                          12));
+    x = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_and_si256(x, mask(0xff00ff0000ff00ffull)),
+            _mm256_slli_epi64(_mm256_and_si256(x, mask(0x00000000ff00ff00ull)),
+                              24)),
+        _mm256_srli_epi64(_mm256_and_si256(x, mask(0x00ff00ff00000000ull)),
+                          24));
+    return x;
   }
-  reward_t slide_down() {
-    transpose();
-    mirror();
-    reward_t score = slide_left();
-    transpose();
-    flip();
-    return score;
+#else
+  static size_t slide_avx2(const board_t *, const uint32_t *, const board_t *,
+                           board_t *, reward_t *, size_t) {
+    return 0;
   }
+#endif
 
 public:
   /**
@@ -121,7 +278,7 @@ public:
    * |     4     2     8    16|       |     4   256   128    16|
    * +------------------------+       +------------------------+
    */
-  void transpose() {
+  constexpr void transpose() {
     raw_ = (raw_ & 0xf0f00f0ff0f00f0full) |
            ((raw_ & 0x0000f0f00000f0f0ull) << 12u) |
            ((raw_ & 0x0f0f00000f0f0000ull) >> 12u);
@@ -139,7 +296,7 @@ public:
    * |     4     2     8    16|       |    16     8     2     4|
    * +------------------------+       +------------------------+
    */
-  void mirror() {
+  constexpr void mirror() {
     raw_ = ((raw_ & 0x000f000f000f000full) << 12u) |
            ((raw_ & 0x00f000f000f000f0ull) << 4u) |
            ((raw_ & 0x0f000f000f000f00ull) >> 4u) |
@@ -155,7 +312,7 @@ public:
    * |     4     2     8    16|       |     2     8   128     4|
    * +------------------------+       +------------------------+
    */
-  void flip() {
+  constexpr void flip() {
     raw_ = ((raw_ & 0x000000000000ffffull) << 48u) |
            ((raw_ & 0x00000000ffff0000ull) << 16u) |
            ((raw_ & 0x0000ffff00000000ull) >> 16u) |
@@ -163,22 +320,42 @@ public:
   }
 
 private:
+  /**
+   * the results of sliding each of the 65536 rows in each direction
+   * left and right hold the row in the low 16 bits and the reward in the high
+   * 16 bits, up and down hold the column at the first column of a board
+   * each direction has its own table, so that a slide touches the least
+   */
   struct lookup {
     using board_t = board::board_t;
     using row_t = board::row_t;
     using tile_t = board::tile_t;
     using reward_t = board::reward_t;
     lookup() {
-      static row_t cur = 0u;
-      raw = cur++;
-      // left
-      left = raw;
-      reward_left = mv_left(left);
+      for (uint32_t raw = 0; raw < 65536; raw++) {
+        row_t l = raw, r = reverse(raw);
+        reward_t reward_left = mv_left(l), reward_right = mv_left(r);
+        r = reverse(r);
+        left[raw] = l | uint32_t(reward_left) << 16;
+        right[raw] = r | uint32_t(reward_right) << 16;
+        up[raw] = spread(l);
+        down[raw] = spread(r);
+      }
+    }
+
+    static const lookup &table() {
+      static const lookup cache;
+      return cache;
     }
 
-    static const lookup &find(size_t row) {
-      static const lookup cache[65536];
-      return cache[row];
+    static row_t reverse(row_t row) {
+      return ((row >> 12) & 0x000f) | ((row >> 4) & 0x00f0) |
+             ((row << 4) & 0x0f00) | ((row << 12) & 0xf000);
+    }
+
+    static board_t spread(row_t row) {
+      board_t c = row;
+      return (c | (c << 12) | (c << 24) | (c << 36)) & 0x000f000f000f000full;
     }
 
     static reward_t mv_left(row_t &row) {
@@ -213,13 +390,8 @@ private:
       return reward;
     }
 
-    reward_t slide_left(board_t &board, size_t i) const {
-      board |= board_t(left) << (i << 4);
-      return reward_left;
-    }
-
-    row_t raw, left;
-    reward_t reward_left;
+    uint32_t left[65536], right[65536];
+    board_t up[65536], down[65536];
   };
 
 public:
@@ -239,4 +411,45 @@ public:
 
 private:
   board_t raw_;
-};
\ No newline at end of file
+};
+
+/**
+ * the afterstates of the four slides (up, right, down, left) of a board
+ * the reward of an illegal slide is -1 (and its afterstate is the board),
+ * and bit op of 'legal' is set if slide op is legal, i.e., the game is over
+ * if no bit is set
+ */
+struct board::moves {
+  board after[4];
+  reward_t reward[4];
+  unsigned legal;
+};
+
+inline board::moves board::slides() const {
+  const lookup &l = lookup::table();
+  board t(*this);
+  t.transpose();
+  board_t cur[4] = {};
+  reward_t score[4] = {};
+  for (size_t i = 0; i < 4; i++) {
+    uint32_t left = l.left[operator[](i)], right = l.right[operator[](i)];
+    uint32_t up = l.left[t[i]], down = l.right[t[i]];
+    cur[0] |= l.up[t[i]] << (i << 2);
+    cur[1] |= board_t(right & 0xffff) << (i << 4);
+    cur[2] |= l.down[t[i]] << (i << 2);
+    cur[3] |= board_t(left & 0xffff) << (i << 4);
+    score[0] += up >> 16;
+    score[1] += right >> 16;
+    score[2] += down >> 16;
+    score[3] += left >> 16;
+  }
+  moves m;
+  m.legal = 0;
+  for (unsigned op = 0; op < 4; op++) {
+    bool legal = cur[op] != raw_;
+    m.after[op] = board(cur[op]);
+    m.reward[op] = legal ? score[op] : -1;
+    m.legal |= unsigned(legal) << op;
+  }
+  return m;
+}
\ No newline at end of file
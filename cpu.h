@@ -0,0 +1,26 @@
+#pragma once
+
+/**
+ * runtime detection of the instruction set extensions
+ * the result is cached, so the query is cheap enough for hot paths
+ */
+struct cpu {
+#if defined(__x86_64__) || defined(__i386__)
+  static bool bmi2() {
+    static const bool support = __builtin_cpu_supports("bmi2");
+    return support;
+  }
+  static bool avx2() {
+    static const bool support = __builtin_cpu_supports("avx2");
+    return support;
+  }
+  static bool avx512f() {
+    static const bool support = __builtin_cpu_supports("avx512f");
+    return support;
+  }
+#else
+  static bool bmi2() { return false; }
+  static bool avx2() { return false; }
+  static bool avx512f() { return false; }
+#endif
+};
@@ -2,23 +2,29 @@
 #include "action.h"
 #include "agent.h"
 #include "board.h"
+#include "timer.h"
 #include <algorithm>
+#include <cassert>
 #include <chrono>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <list>
 #include <numeric>
 #include <sstream>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 class statistic;
+class episode_log;
 
 class episode {
   friend class statistic;
+  friend class episode_log;
 
 public:
-  episode() : ep_state(initial_state()), ep_score(0), ep_time(0) {
-    ep_moves.reserve(10000);
-  }
+  episode() : ep_state(initial_state()), ep_score(0), ep_time(0) {}
 
 public:
   board &state() { return ep_state; }
@@ -26,17 +32,20 @@ public:
   board::reward_t score() const { return ep_score; }
 
   void open_episode(const std::string &tag) { ep_open = {tag, millisec()}; }
-  void close_episode(const std::string &tag) { ep_close = {tag, millisec()}; }
+  void close_episode(const std::string &tag) {
+    ep_close = {tag, millisec()};
+    ep_moves.shrink_to_fit(); // the moves are final
+  }
   bool apply_action(action move) {
     board::reward_t reward = move.apply(state());
     if (reward == -1)
       return false;
-    ep_moves.emplace_back(move, reward, millisec() - ep_time);
+    ep_moves.push_back({move, reward, timer::now() - ep_time});
     ep_score += reward;
     return true;
   }
   agent &take_turns(agent &play, agent &evil) {
-    ep_time = millisec();
+    ep_time = timer::now();
     return (std::max(step() + 1, 9ul) & 1) ? evil : play;
   }
   agent &last_turns(agent &play, agent &evil) { return take_turns(evil, play); }
@@ -54,7 +63,19 @@ public:
     }
   }
 
+  /**
+   * the duration of the episode, or the time spent by 'who' in milliseconds
+   */
   time_t time(unsigned who = -1u) const {
+    if (who == action::place::type || who == action::slide::type)
+      return elapsed(who) / 1000;
+    return ep_close.when - ep_open.when;
+  }
+
+  /**
+   * the time spent by 'who' in microseconds, i.e., the sum of its moves
+   */
+  time_t elapsed(unsigned who) const {
     time_t time = 0;
     size_t i = 2;
     switch (who) {
@@ -66,9 +87,6 @@ public:
       while (i < ep_moves.size())
         time += ep_moves[i].time, i += 2;
       break;
-    default:
-      time = ep_close.when - ep_open.when;
-      break;
     }
     return time;
   }
@@ -86,7 +104,9 @@ public:
         res.push_back(ep_moves[i]), i += 2;
       break;
     default:
-      res.assign(ep_moves.begin(), ep_moves.end());
+      res.reserve(ep_moves.size());
+      for (const move &mv : ep_moves)
+        res.push_back(mv);
       break;
     }
     return res;
@@ -107,20 +127,73 @@ public:
     std::stringstream(token) >> ep.ep_open;
     std::getline(in, token, '|');
     for (std::stringstream moves(token); !moves.eof(); moves.peek()) {
-      ep.ep_moves.emplace_back();
-      moves >> ep.ep_moves.back();
-      ep.ep_score += action(ep.ep_moves.back()).apply(ep.ep_state);
+      move mv;
+      moves >> mv;
+      ep.ep_moves.push_back(mv);
+      ep.ep_score += action(mv).apply(ep.ep_state);
     }
     std::getline(in, token, '|');
     std::stringstream(token) >> ep.ep_close;
     return in;
   }
 
+  /**
+   * parse a line of operator<< by hand, which is what operator>> reads but
+   * without the streams and the action prototypes
+   * return false if the line is not in the exact format, e.g., empty moves,
+   * and leave it to operator>>
+   */
+  bool parse(const char *first, const char *last) {
+    const char *bar = std::find(first, last, '|');
+    const char *mid = std::find(std::min(bar + 1, last), last, '|');
+    const char *end = std::find(std::min(mid + 1, last), last, '|');
+    if (mid == last || !parse(first, bar, ep_open) ||
+        !parse(mid + 1, end, ep_close))
+      return false;
+    board state = initial_state();
+    board::reward_t score = 0;
+    move_list moves;
+    moves.reserve((mid - bar) / 2);
+    for (const char *p = bar + 1; p != mid;) {
+      action code;
+      if (*p == '#' && mid - p >= 2) {
+        const char *opc = "URDL";
+        unsigned oper = std::find(opc, opc + 4, p[1]) - opc;
+        if (oper == 4)
+          return false;
+        code = action::slide(oper);
+        score += state.slide(oper);
+      } else if (mid - p >= 2) {
+        unsigned pos = digit(p[0]), tile = digit(p[1]);
+        if (pos >= 16 || tile >= 36)
+          return false;
+        code = action::place(pos, tile);
+        score += state.place(pos, tile);
+      } else {
+        return false;
+      }
+      p += 2;
+      long long reward = 0, time = 0;
+      if (p != mid && *p == '[' && !(p = integer(p + 1, mid, ']', reward)))
+        return false;
+      if (p != mid && *p == '(' && !(p = integer(p + 1, mid, ')', time)))
+        return false;
+      moves.push_back({code, board::reward_t(reward), time_t(time * 1000)});
+    }
+    if (moves.empty())
+      return false;
+    ep_state = state;
+    ep_score = score;
+    ep_moves = std::move(moves);
+    ep_moves.shrink_to_fit();
+    return true;
+  }
+
 protected:
   struct move {
     action code;
     board::reward_t reward;
-    time_t time;
+    time_t time; // in microseconds, written in milliseconds
     move(action code = {}, board::reward_t reward = 0, time_t time = 0)
         : code(code), reward(reward), time(time) {}
 
@@ -129,8 +202,8 @@ protected:
       out << m.code;
       if (m.reward)
         out << '[' << std::dec << m.reward << ']';
-      if (m.time)
-        out << '(' << std::dec << m.time << ')';
+      if (m.time / 1000)
+        out << '(' << std::dec << (m.time / 1000) << ')';
       return out;
     }
     friend std::istream &operator>>(std::istream &in, move &m) {
@@ -145,12 +218,98 @@ protected:
       if (in.peek() == '(') {
         in.ignore(1);
         in >> std::dec >> m.time;
+        m.time *= 1000;
         in.ignore(1);
       }
       return in;
     }
   };
 
+  /**
+   * the moves of an episode, packed as codes of 2 bytes
+   *   place: tile << 4 | position
+   *   slide: 0xfff0 | opcode
+   *   other: 0xffff, e.g., an unknown token of the text
+   * with the rewards and the times in side arrays, which are allocated at the
+   * first nonzero value and are 0 past their ends, e.g., there are no times
+   * at all if the timer is off
+   *   reward: int16, since a slide merges at most 4 tiles of 6144
+   *   time:   uint32 in microseconds, i.e., at most about 71 minutes
+   * both saturate, which only matters for a corrupted file
+   *
+   * a move is unpacked as a value, so only the time and the reward can be
+   * changed in place
+   */
+  class move_list {
+  public:
+    size_t size() const { return codes.size(); }
+    bool empty() const { return codes.empty(); }
+    void reserve(size_t n) { codes.reserve(n); }
+    void shrink_to_fit() {
+      codes.shrink_to_fit();
+      rewards.shrink_to_fit();
+      times.shrink_to_fit();
+    }
+
+    move operator[](size_t i) const {
+      return {unpack(codes[i]), i < rewards.size() ? rewards[i] : 0,
+              i < times.size() ? times[i] : 0};
+    }
+    void push_back(const move &m) {
+      set(rewards, codes.size(), m.reward);
+      set(times, codes.size(), m.time);
+      codes.push_back(pack(m.code));
+    }
+    void set_time(size_t i, time_t time) { set(times, i, time); }
+    void set_reward(size_t i, board::reward_t reward) {
+      set(rewards, i, reward);
+    }
+
+    class const_iterator {
+    public:
+      const_iterator(const move_list &list, size_t i) : list(list), i(i) {}
+      move operator*() const { return list[i]; }
+      const_iterator &operator++() { return ++i, *this; }
+      bool operator!=(const const_iterator &it) const { return i != it.i; }
+
+    private:
+      const move_list &list;
+      size_t i;
+    };
+    const_iterator begin() const { return {*this, 0}; }
+    const_iterator end() const { return {*this, size()}; }
+
+  private:
+    static uint16_t pack(action a) {
+      if (a.type() == action::slide::type)
+        return 0xfff0 | (a.event() & 0b11);
+      if (a.type() == action::place::type)
+        return a.event();
+      return 0xffff;
+    }
+    static action unpack(uint16_t c) {
+      if (c < 0xfff0)
+        return action::place(c & 0x0f, c >> 4);
+      if (c < 0xfff4)
+        return action::slide(c & 0b11);
+      return {};
+    }
+    template <typename T>
+    static void set(std::vector<T> &side, size_t i, int64_t v) {
+      if (i >= side.size() && v == 0)
+        return;
+      if (i >= side.size())
+        side.resize(i + 1);
+      int64_t lo = std::numeric_limits<T>::min();
+      int64_t hi = std::numeric_limits<T>::max();
+      side[i] = T(std::max(lo, std::min(v, hi)));
+    }
+
+    std::vector<uint16_t> codes;
+    std::vector<int16_t> rewards;
+    std::vector<uint32_t> times;
+  };
+
   struct meta {
     std::string tag;
     time_t when;
@@ -165,6 +324,43 @@ protected:
     }
   };
 
+  /**
+   * parse "tag@when" of meta
+   */
+  static bool parse(const char *first, const char *last, meta &m) {
+    const char *at = std::find(first, last, '@');
+    long long when = 0;
+    if (at == last || integer(at + 1, last, 0, when) != last)
+      return false;
+    m = {std::string(first, at), time_t(when)};
+    return true;
+  }
+  /**
+   * the value of a digit of base 36, or 36 if not a digit
+   */
+  static unsigned digit(char c) {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'A' && c <= 'Z')
+      return c - 'A' + 10;
+    return 36;
+  }
+  /**
+   * parse the decimal integer at 'p' up to 'delim', which is skipped, or up to
+   * 'last' if 'delim' is 0, return the end or nullptr if not an integer
+   */
+  static const char *integer(const char *p, const char *last, char delim,
+                             long long &v) {
+    bool neg = p != last && *p == '-';
+    const char *digits = p += neg;
+    for (v = 0; p != last && *p >= '0' && *p <= '9'; p++)
+      v = v * 10 + (*p - '0');
+    v = neg ? -v : v;
+    if (p == digits || (delim && (p == last || *p++ != delim)))
+      return nullptr;
+    return p;
+  }
+
   static board initial_state() { return board(); }
   static time_t millisec() {
     auto now = std::chrono::system_clock::now().time_since_epoch();
@@ -174,9 +370,208 @@ protected:
 private:
   board ep_state;
   board::reward_t ep_score;
-  std::vector<move> ep_moves;
-  time_t ep_time;
+  move_list ep_moves;
+  int64_t ep_time; // the beginning of the turn, see timer
 
   meta ep_open;
   meta ep_close;
 };
+
+/**
+ * the binary log of episodes, losslessly converted to and from the text format
+ * of operator<<, at about 1 byte per move instead of 4 to 10
+ *
+ * layout:
+ *   magic, then the episodes until the end
+ *
+ * episode:
+ *   varint  moves
+ *   tag     of open, e.g., "tdl:random"
+ *   zigzag  open time - close time of the previous episode (or 0)
+ *   tag     of close, i.e., the winner
+ *   zigzag  close time - open time
+ *   byte    move[moves]    place: tile << 4 | position, tile < 15
+ *                          slide: 0xf0 | opcode
+ *                          other: 0xff, e.g., an unknown token of the text
+ *   varint  timed, i.e., the moves of nonzero time in milliseconds
+ *   varint  index - index of the previous timed move (or 0), zigzag time
+ *           ... for each timed move
+ *   varint  fixed, i.e., the moves whose reward is not the replayed one,
+ *           e.g., the moves after an unknown token, usually none
+ *   varint  index - index of the previous fixed move (or 0), zigzag reward
+ *           ... for each fixed move
+ *
+ * tag:
+ *   varint  the index of the tags seen so far in the log, if the index is
+ *           that of a new tag, it is followed by the varint length and the
+ *           characters of the tag
+ *
+ * the rewards are replayed on the board rather than stored, and the tags are
+ * defined at their first use, hence the episodes should be read in the order
+ * they are written, by an episode_log of their own
+ */
+class episode_log {
+public:
+  static const char *magic() { return "TRSLOG1"; }
+
+  /**
+   * write the magic, or check the magic and consume it if it matches
+   */
+  static void header(std::ostream &out) {
+    out.write(magic(), std::strlen(magic()) + 1);
+  }
+  static bool header(std::istream &in) {
+    char head[8] = {};
+    size_t len = std::strlen(magic()) + 1;
+    auto pos = in.tellg();
+    if (in.read(head, len) && std::memcmp(head, magic(), len) == 0)
+      return true;
+    in.clear();
+    in.seekg(pos);
+    return false;
+  }
+
+  void write(std::ostream &out, const episode &ep) {
+    put(out, ep.ep_moves.size());
+    put(out, ep.ep_open, last_);
+    put(out, ep.ep_close, ep.ep_open.when);
+    last_ = ep.ep_close.when;
+    std::string code(ep.ep_moves.size(), 0);
+    std::vector<size_t> fixed;
+    size_t timed = 0;
+    board state = episode::initial_state();
+    for (size_t i = 0; i < ep.ep_moves.size(); i++) {
+      action a = ep.ep_moves[i];
+      if (std::max(a.apply(state), 0) != ep.ep_moves[i].reward)
+        fixed.push_back(i);
+      action::place p(a);
+      if (a.type() == action::slide::type)
+        code[i] = 0xf0 | (a.event() & 0b11);
+      else if (a.type() == action::place::type && p.tile() < 15)
+        code[i] = p.tile() << 4 | p.position();
+      else
+        code[i] = 0xff;
+      timed += ep.ep_moves[i].time / 1000 != 0;
+    }
+    out.write(&code[0], code.size());
+    put(out, timed);
+    for (size_t i = 0, last = 0; i < ep.ep_moves.size(); i++) {
+      if (ep.ep_moves[i].time / 1000 == 0)
+        continue;
+      put(out, i - last);
+      put(out, zigzag(ep.ep_moves[i].time / 1000));
+      last = i;
+    }
+    put(out, fixed.size());
+    for (size_t i = 0, last = 0; i < fixed.size(); last = fixed[i++]) {
+      put(out, fixed[i] - last);
+      put(out, zigzag(ep.ep_moves[fixed[i]].reward));
+    }
+  }
+
+  /**
+   * read an episode, return false at the end of the log
+   */
+  bool read(std::istream &in, episode &ep) {
+    uint64_t moves;
+    if (!get(in, moves))
+      return false;
+    ep = {};
+    get(in, ep.ep_open, last_);
+    get(in, ep.ep_close, ep.ep_open.when);
+    last_ = ep.ep_close.when;
+    std::string code(moves, 0);
+    in.read(&code[0], moves);
+    ep.ep_moves.reserve(moves);
+    for (uint8_t c : code) {
+      action a = c == 0xff  ? action()
+                 : c >= 0xf0 ? action(action::slide(c & 0b11))
+                             : action(action::place(c & 0x0f, c >> 4));
+      // a move that fails to apply counts -1 as operator>> does, but it has
+      // no reward of its own
+      board::reward_t reward = a.apply(ep.ep_state);
+      ep.ep_moves.push_back({a, std::max(reward, 0), 0});
+      ep.ep_score += reward;
+    }
+    uint64_t timed = 0, index = 0, time = 0;
+    get(in, timed);
+    for (size_t i = 0, last = 0; i < timed && get(in, index); i++) {
+      get(in, time);
+      last += index;
+      if (last < ep.ep_moves.size())
+        ep.ep_moves.set_time(last, unzigzag(time) * 1000);
+    }
+    uint64_t fixed = 0, reward = 0;
+    get(in, fixed);
+    for (size_t i = 0, last = 0; i < fixed && get(in, index); i++) {
+      get(in, reward);
+      last += index;
+      if (last < ep.ep_moves.size())
+        ep.ep_moves.set_reward(last, unzigzag(reward));
+    }
+    return bool(in);
+  }
+
+private:
+  static uint64_t zigzag(int64_t v) { return uint64_t(v) << 1 ^ (v >> 63); }
+  static int64_t unzigzag(uint64_t v) {
+    return int64_t(v >> 1) ^ -int64_t(v & 1);
+  }
+
+  static void put(std::ostream &out, uint64_t v) {
+    char buf[10];
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7)
+      buf[n++] = char(v | 0x80);
+    buf[n++] = char(v);
+    out.write(buf, n);
+  }
+  static bool get(std::istream &in, uint64_t &v) {
+    v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      int c = in.get();
+      if (c == EOF)
+        return false;
+      v |= uint64_t(c & 0x7f) << shift;
+      if (c < 0x80)
+        return true;
+    }
+    return false;
+  }
+
+  /**
+   * the tag of a meta and its time relative to 'since'
+   */
+  void put(std::ostream &out, const episode::meta &m, time_t since) {
+    auto it = index_.find(m.tag);
+    if (it != index_.end()) {
+      put(out, it->second);
+    } else {
+      put(out, tags_.size());
+      put(out, m.tag.size());
+      out.write(m.tag.data(), m.tag.size());
+      index_[m.tag] = tags_.size();
+      tags_.push_back(m.tag);
+    }
+    put(out, zigzag(m.when - since));
+  }
+  void get(std::istream &in, episode::meta &m, time_t since) {
+    uint64_t index = 0, when = 0;
+    get(in, index);
+    if (index >= tags_.size()) {
+      uint64_t len = 0;
+      get(in, len);
+      std::string tag(len, 0);
+      in.read(&tag[0], len);
+      tags_.push_back(tag);
+      index = tags_.size() - 1;
+    }
+    get(in, when);
+    m = {tags_[index], since + unzigzag(when)};
+  }
+
+private:
+  std::vector<std::string> tags_;
+  std::unordered_map<std::string, size_t> index_;
+  time_t last_ = 0;
+};
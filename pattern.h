@@ -1,108 +1,281 @@
 #pragma once
 #include "board.h"
+#include "cpu.h"
+#include "weight.h"
+#include <array>
 #include <cassert>
+#include <cmath>
+#include <initializer_list>
 #include <iterator>
 #include <sstream>
+#include <utility>
 #include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /**
- * the pattern feature including isomorphism
+ * the symmetry-expanded board, i.e., all isomorphisms of a board in the order
+ * of board::isomorphism, derived from each other with the least transforms
+ *
+ * expand a board once, then every pattern indexes its isomorphisms at the
+ * original cells
+ */
+class symmetry : public std::array<board::board_t, 8> {
+public:
+  explicit symmetry(const board &b) {
+    board m(b), f(b);
+    m.mirror();
+    f.flip();
+    board mf(m), t(b), mt(m);
+    mf.flip();
+    t.transpose();
+    mt.transpose();
+    board tm(t), tf(t), mtm(mt), mtf(mt);
+    tm.mirror();
+    tf.flip();
+    mtm.mirror();
+    mtf.flip();
+    *this = {{b.raw(), tm.raw(), mf.raw(), tf.raw(), m.raw(), mtm.raw(),
+              f.raw(), mtf.raw()}};
+  }
+
+private:
+  symmetry &operator=(const std::array<board::board_t, 8> &iso) {
+    std::array<board::board_t, 8>::operator=(iso);
+    return *this;
+  }
+};
+
+/**
+ * the n-tuple pattern feature including isomorphism
+ * the index of each isomorphism is extracted from the symmetry-expanded board
+ * at the original cells, which are known at compile time, so that every lookup
+ * is fully unrolled
  *
  * usage:
- *   pattern({ 0, 1, 2, 3 })
- *   pattern({ 0, 1, 2, 3, 4, 5 })
+ *   tuple_pattern<0, 1, 2, 3>
+ *   tuple_pattern<0, 1, 2, 3, 4, 5>
  *
  * isomorphic level of the pattern:
  *   1: no isomorphism
  *   4: enable rotation
  *   8: enable rotation and reflection
  */
-class pattern {
+template <board::tile_t... cells> class tuple_pattern {
+  constexpr static const size_t iso_level_ = 8;
+
 public:
-  pattern() = default;
-  pattern(const std::vector<board::tile_t> &p) : weight_(1 << (p.size() << 2)) {
-    size_t psize = p.size();
-    assert(psize != 0);
-    for (size_t i = 0; i < iso_level_; ++i) {
-      board idx(0xfedcba9876543210ull);
-      if (i >= 4) {
-        idx.mirror();
-      }
-      idx.rotate_clockwise(i);
-      isomorphism[i].reserve(psize);
-      for (auto t : p) {
-        isomorphism[i].push_back(idx(t));
-      }
-    }
+  tuple_pattern() {
+    static_assert(sizeof...(cells) != 0, "empty pattern");
+    static_assert(sizeof...(cells) < 8, "index should fit in 32 bits");
+    static_assert(ascending(), "cells should be in ascending order");
   }
-  pattern(const pattern &) = default;
-  pattern(pattern &&) = default;
-  pattern &operator=(const pattern &) = default;
-  pattern &operator=(pattern &&) = default;
-  ~pattern() = default;
+  tuple_pattern(const tuple_pattern &) = default;
+  tuple_pattern(tuple_pattern &&) = default;
+  tuple_pattern &operator=(const tuple_pattern &) = default;
+  tuple_pattern &operator=(tuple_pattern &&) = default;
+  ~tuple_pattern() = default;
 
 public:
   /**
-   * estimate the value of a given board
+   * the weight table, indexed by indexof
+   * the table is empty until assigned, e.g., allocated or mapped from a file
    */
-  float estimate(const board &b) const {
-    float value = 0;
-    for (size_t i = 0; i < iso_level_; ++i) {
-      size_t index = indexof(isomorphism[i], b);
-      value += weight_[index];
-    }
-    return value;
+  const weight_table &table() const { return weight_; }
+  void assign(const weight_table &table) {
+    assert(table.size() == size());
+    weight_ = table;
+  }
+  static constexpr size_t size() { return 1ull << (sizeof...(cells) << 2); }
+
+  /**
+   * the accumulators of temporal coherence (TC) learning of each weight, in
+   * pairs of 16 bits so that both are in the same cache line, and the pairs
+   * take as many bytes as fp32 weights
+   *   the coherence, i.e., sum of updates / sum of |updates|, in Q15
+   *   the sum of |updates|, in fp16
+   * the table is empty unless TC learning is enabled
+   */
+  const weight_table &coherence() const { return coherence_; }
+  void assign_coherence(const weight_table &table) {
+    assert(table.size() == 2 * size());
+    coherence_ = table;
   }
 
   /**
    * update the value of a given board, and return its updated value
+   * the weights are accumulated as float, then stored back in 'storage'
+   * with TC learning, each update is scaled by the coherence of the weight,
+   * i.e., |sum of updates| / sum of |updates|, which is 1 before any update
+   * the coherence is kept as the ratio rather than the sum of updates, which
+   * fp16 cannot accumulate precisely, and the sum of |updates| is halved
+   * before it overflows fp16, which keeps the ratio
    */
-  float update(const board &b, float u) {
+  template <weight_table::storage_t storage>
+  float update(const symmetry &iso, float u) {
+    using codec = weight_codec<storage>;
+    using half = weight_codec<weight_table::fp16>;
+    auto *weight = weight_.template data<typename codec::type>();
+    auto *tc = coherence_.size() ? coherence_.template data<int16_t>()
+                                 : nullptr;
+    float scale = weight_.scale();
     float u_split = u / iso_level_;
     float value = 0;
-    for (size_t i = 0; i < iso_level_; ++i) {
-      size_t index = indexof(isomorphism[i], b);
-      weight_[index] += u_split;
-      value += weight_[index];
+    for (size_t index : indexof(iso)) {
+      float step = u_split;
+      if (tc) {
+        int16_t *acc = tc + 2 * index;
+        float ratio = acc[0] * (1.0f / 32767);
+        float abs = half::decode(acc[1], 1);
+        if (abs != 0)
+          step *= std::fabs(ratio);
+        float sum = ratio * abs + u_split;
+        abs += std::fabs(u_split);
+        if (abs != 0)
+          acc[0] = int16_t(std::nearbyint(sum / abs * 32767));
+        while (abs >= 32768)
+          abs /= 2;
+        acc[1] = half::encode(abs, 1);
+      }
+      float w = codec::decode(weight[index], scale) + step;
+      weight[index] = codec::encode(w, scale);
+      value += codec::decode(weight[index], scale);
     }
     return value;
   }
 
+public:
+  /**
+   * the indexes of all isomorphisms of a given board
+   * shift and mask the runs of consecutive cells, which vectorizes well over
+   * the isomorphisms; for the scattered cells with many runs, use BMI2 PEXT if
+   * the CPU supports it
+   */
+  static std::array<size_t, iso_level_> indexof(const symmetry &iso) {
+    if (runs() > 5 && cpu::bmi2())
+      return indexof_pext(iso);
+    return indexof_shift(iso);
+  }
+  static std::array<size_t, iso_level_> indexof_pext(const symmetry &iso) {
+    return indexof_pext(iso, std::make_index_sequence<iso_level_>());
+  }
+  static std::array<size_t, iso_level_> indexof_shift(const symmetry &iso) {
+    return indexof_shift(iso, std::make_index_sequence<iso_level_>());
+  }
+
 private:
-  size_t indexof(const std::vector<board::tile_t> &p, const board &b) const {
+#if defined(__x86_64__) || defined(__i386__)
+  template <size_t... i>
+  __attribute__((target("bmi2"))) static std::array<size_t, iso_level_>
+  indexof_pext(const symmetry &iso, std::index_sequence<i...>) {
+    return {{pext(iso[i])...}};
+  }
+#else
+  template <size_t... i>
+  static std::array<size_t, iso_level_>
+  indexof_pext(const symmetry &iso, std::index_sequence<i...> seq) {
+    return indexof_shift(iso, seq);
+  }
+#endif
+  template <size_t... i>
+  static std::array<size_t, iso_level_>
+  indexof_shift(const symmetry &iso, std::index_sequence<i...>) {
+    return {{shift(iso[i])...}};
+  }
+
+  /**
+   * extract the index of the cells from a raw board
+   */
+#if defined(__x86_64__) || defined(__i386__)
+  __attribute__((target("bmi2"))) static size_t pext(board::board_t raw) {
+    return _pext_u64(raw, mask());
+  }
+#endif
+  static size_t shift(board::board_t raw) {
+    return shift(raw, std::make_index_sequence<17 - sizeof...(cells)>());
+  }
+
+  /**
+   * the cells of a run share the same shift d, i.e., cell k of the pattern is
+   * at cell (k + d) of the board, hence a run is extracted by one shift and one
+   * mask, e.g., 2 runs for cells { 0, 1, 2, 4, 5, 6 }
+   */
+  template <size_t... d>
+  static size_t shift(board::board_t raw, std::index_sequence<d...>) {
     size_t index = 0;
-    for (size_t i = 0; i < p.size(); ++i)
-      index |= b(p[i]) << (i << 2);
+    (void)std::initializer_list<int>{
+        (index |= (raw >> (d << 2)) &
+                  std::integral_constant<board::board_t, run(d)>::value,
+         0)...};
     return index;
   }
 
+  static constexpr board::board_t run(size_t d) {
+    board::board_t m = 0;
+    size_t k = 0;
+    for (board::tile_t t : {cells...}) {
+      if (t == k + d)
+        m |= 0x0full << (k << 2);
+      k++;
+    }
+    return m;
+  }
+
+  static constexpr size_t runs() {
+    size_t n = 0;
+    for (size_t d = 0; d <= 16 - sizeof...(cells); d++)
+      n += run(d) != 0;
+    return n;
+  }
+
+  static constexpr bool ascending() {
+    int prev = -1;
+    for (board::tile_t t : {cells...}) {
+      if (t <= prev || t >= 16)
+        return false;
+      prev = t;
+    }
+    return true;
+  }
+
+  static constexpr board::board_t mask() {
+    board::board_t m = 0;
+    for (board::tile_t t : {cells...})
+      m |= 0x0full << (t << 2);
+    return m;
+  }
+
 public:
-  std::string nameof(const std::vector<board::tile_t> &p) const {
+  static std::string nameof(const std::vector<board::tile_t> &p) {
     std::stringstream ss;
     ss << std::hex;
     std::copy(std::begin(p), std::end(p),
               std::ostream_iterator<board::tile_t>(ss, ""));
     return ss.str();
   }
-  std::string name() const {
-    return std::to_string(isomorphism[0].size()) + "-tuple pattern " +
-           nameof(isomorphism[0]);
+  static std::string name() {
+    return std::to_string(sizeof...(cells)) + "-tuple pattern " +
+           nameof({cells...});
   }
 
-  friend std::ostream &operator<<(std::ostream &out, const pattern &p) {
+  friend std::ostream &operator<<(std::ostream &out, const tuple_pattern &p) {
     std::string name = p.name();
     uint32_t len = name.length();
     out.write(reinterpret_cast<char *>(&len), sizeof(len));
     out.write(name.c_str(), len);
     // weight
-    uint64_t size = p.weight_.size();
+    weight_table weight = p.weight_.storage() == weight_table::fp32
+                              ? p.weight_
+                              : p.weight_.convert(weight_table::fp32);
+    uint64_t size = weight.size();
     out.write(reinterpret_cast<const char *>(&size), sizeof(size));
-    out.write(reinterpret_cast<const char *>(p.weight_.data()),
+    out.write(reinterpret_cast<const char *>(weight.data()),
               sizeof(float) * size);
     return out;
   }
 
-  friend std::istream &operator>>(std::istream &in, pattern &p) {
+  friend std::istream &operator>>(std::istream &in, tuple_pattern &p) {
     std::string name;
     uint32_t len = 0;
     in.read(reinterpret_cast<char *>(&len), sizeof(len));
@@ -112,13 +285,12 @@ public:
     // weight
     uint64_t size = 0;
     in.read(reinterpret_cast<char *>(&size), sizeof(size));
-    p.weight_.resize(size);
+    p.weight_ = weight_table(size);
     in.read(reinterpret_cast<char *>(p.weight_.data()), sizeof(float) * size);
     return in;
   }
 
 private:
-  constexpr static const size_t iso_level_ = 8;
-  std::array<std::vector<board::tile_t>, iso_level_> isomorphism;
-  std::vector<float> weight_;
-};
\ No newline at end of file
+  weight_table weight_;
+  weight_table coherence_;
+};
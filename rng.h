@@ -0,0 +1,104 @@
+#pragma once
+#include <cstdint>
+#include <limits>
+
+/**
+ * xoshiro256** pseudorandom generator, seeded by splitmix64
+ * a UniformRandomBitGenerator, so it works with std::shuffle and the standard
+ * distributions, but 'below' is much cheaper for the small ranges of the game
+ *
+ * independent streams of the same seed:
+ *   split(n): the n-th stream, by hashing the state with n, e.g., one stream
+ *             per episode so that episode n is the same on any worker
+ *   jump():   advance 2^128 draws, e.g., one stream per thread
+ */
+class xoshiro256 {
+public:
+  typedef uint64_t result_type;
+
+  explicit xoshiro256(uint64_t seed = 0) { this->seed(seed); }
+
+  void seed(uint64_t seed) {
+    for (uint64_t &s : s_)
+      s = splitmix64(seed);
+  }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() {
+    return std::numeric_limits<result_type>::max();
+  }
+
+  result_type operator()() {
+    uint64_t result = rotl(s_[1] * 5, 7) * 9;
+    uint64_t t = s_[1] << 17;
+    s_[2] ^= s_[0];
+    s_[3] ^= s_[1];
+    s_[1] ^= s_[2];
+    s_[0] ^= s_[3];
+    s_[2] ^= t;
+    s_[3] = rotl(s_[3], 45);
+    return result;
+  }
+
+  /**
+   * a uniformly random integer in [0, n), n > 0
+   * multiply the high 32 bits of a draw by n, and reject the few low products
+   * that would bias the result (Lemire), hence no division in the common case
+   */
+  uint32_t below(uint32_t n) {
+    uint64_t m = ((*this)() >> 32) * n;
+    if (uint32_t(m) < n) {
+      uint32_t threshold = -n % n;
+      while (uint32_t(m) < threshold)
+        m = ((*this)() >> 32) * n;
+    }
+    return m >> 32;
+  }
+
+  xoshiro256 split(uint64_t n) const {
+    xoshiro256 stream;
+    uint64_t x = s_[0] ^ rotl(s_[1], 16) ^ rotl(s_[2], 32) ^ rotl(s_[3], 48);
+    x ^= splitmix64(n);
+    stream.seed(x);
+    return stream;
+  }
+
+  void jump() {
+    static const uint64_t poly[] = {
+        0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull, 0xa9582618e03fc9aaull,
+        0x39abdc4529b1661cull};
+    uint64_t s[4] = {};
+    for (uint64_t p : poly) {
+      for (int b = 0; b < 64; b++) {
+        if (p & (1ull << b)) {
+          for (int i = 0; i < 4; i++)
+            s[i] ^= s_[i];
+        }
+        (*this)();
+      }
+    }
+    for (int i = 0; i < 4; i++)
+      s_[i] = s[i];
+  }
+
+  bool operator==(const xoshiro256 &rhs) const {
+    return s_[0] == rhs.s_[0] && s_[1] == rhs.s_[1] && s_[2] == rhs.s_[2] &&
+           s_[3] == rhs.s_[3];
+  }
+  bool operator!=(const xoshiro256 &rhs) const { return !(*this == rhs); }
+
+private:
+  static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+  /**
+   * the next output of splitmix64, advancing its state 'x'
+   */
+  static uint64_t splitmix64(uint64_t &x) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+
+  uint64_t s_[4];
+};
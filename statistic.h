@@ -4,9 +4,178 @@
 #include "board.h"
 #include "episode.h"
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
-#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * the file of the episodes, written by a background thread as they close
+ *
+ * the serialized episodes wait in a queue of at most 'capacity' records, which
+ * blocks the players if the disk falls behind; the writer takes all the queued
+ * records as one write, and syncs the file every second, so that a killed run
+ * keeps all but the last second of its episodes
+ * the file is written as 'path.part' and renamed to 'path' once closed, hence
+ * a run may load the file it saves to
+ */
+class episode_sink {
+public:
+  episode_sink(const std::string &path, size_t capacity = 4096)
+      : path_(path), capacity_(capacity) {
+    fd_ = ::open((path_ + ".part").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ == -1) {
+      std::perror(path_.c_str());
+      return;
+    }
+    writer_ = std::thread(&episode_sink::run, this);
+  }
+  ~episode_sink() { close(); }
+
+  void push(std::string &&record) {
+    if (fd_ == -1)
+      return;
+    std::unique_lock<std::mutex> lock(mutex_);
+    space_.wait(lock, [this]() { return queue_.size() < capacity_; });
+    queue_.push_back(std::move(record));
+    ready_.notify_one();
+  }
+
+  /**
+   * write the queued records, sync and rename the file
+   */
+  void close() {
+    if (fd_ == -1)
+      return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    ready_.notify_one();
+    writer_.join();
+    ::close(fd_);
+    fd_ = -1;
+    std::rename((path_ + ".part").c_str(), path_.c_str());
+  }
+
+private:
+  void run() {
+    typedef std::chrono::steady_clock clock;
+    auto synced = clock::now();
+    std::string batch;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this]() { return queue_.size() || closed_; });
+        if (queue_.empty())
+          break;
+        for (; queue_.size(); queue_.pop_front())
+          batch += queue_.front();
+      }
+      space_.notify_all();
+      for (size_t n = 0; n < batch.size();) {
+        ssize_t k = ::write(fd_, batch.data() + n, batch.size() - n);
+        if (k == -1 && errno == EINTR)
+          continue;
+        if (k == -1) {
+          std::perror(path_.c_str());
+          break;
+        }
+        n += k;
+      }
+      batch.clear();
+      if (clock::now() - synced >= std::chrono::seconds(1)) {
+        ::fdatasync(fd_);
+        synced = clock::now();
+      }
+    }
+    ::fdatasync(fd_);
+  }
+
+  std::string path_;
+  size_t capacity_;
+  int fd_;
+  std::deque<std::string> queue_;
+  std::mutex mutex_;
+  std::condition_variable ready_, space_;
+  bool closed_ = false;
+  std::thread writer_;
+};
+
+/**
+ * the log-linear histogram of the move latencies in microseconds
+ * a value below 16 has a bucket of its own, and each power of two above is
+ * split into 16 buckets, hence a percentile is off by at most 1/16
+ * histograms of blocks or threads are merged by adding up the buckets
+ */
+class latency_histogram {
+public:
+  void record(uint64_t us) {
+    count_[bucket(us)]++;
+    total_++;
+    max_ = std::max(max_, us);
+  }
+  latency_histogram &operator+=(const latency_histogram &h) {
+    for (size_t b = 0; b < buckets; b++)
+      count_[b] += h.count_[b];
+    total_ += h.total_;
+    max_ = std::max(max_, h.max_);
+    return *this;
+  }
+
+  uint64_t count() const { return total_; }
+  uint64_t max() const { return max_; }
+
+  /**
+   * the value that a fraction 'q' of the records are at most, i.e., the upper
+   * bound of its bucket
+   */
+  uint64_t percentile(double q) const {
+    uint64_t rank = std::max<uint64_t>(std::ceil(q * total_), 1), seen = 0;
+    for (size_t b = 0; b < buckets; b++) {
+      seen += count_[b];
+      if (seen >= rank)
+        return std::min(upper(b), max_);
+    }
+    return max_;
+  }
+
+private:
+  static constexpr size_t buckets = 61 * 16;
+
+  static size_t bucket(uint64_t v) {
+    if (v < 16)
+      return v;
+    unsigned k = 63 - __builtin_clzll(v);
+    return (k - 3) * 16 + ((v >> (k - 4)) & 15);
+  }
+  static uint64_t upper(size_t b) {
+    if (b < 16)
+      return b;
+    unsigned k = b / 16 + 3;
+    return ((16 + b % 16 + 1) << (k - 4)) - 1;
+  }
+
+  uint64_t count_[buckets] = {0};
+  uint64_t total_ = 0, max_ = 0;
+};
 
 class statistic {
 public:
@@ -19,14 +188,22 @@ public:
    */
   statistic(size_t total, size_t block = 0, size_t limit = 0)
       : total(total), block(block ? block : total),
-        limit(limit ? limit : total), count(0) {}
+        limit(limit), count(0), head(0), issued(0),
+        since(episode::millisec()) {
+    // the ring is reserved only if its size is fixed, all the episodes
+    // could be too many to reserve at once
+    if (limit)
+      data.reserve(limit);
+  }
 
 public:
   /**
-   * show the statistic of last 'block' games
+   * show the statistic of the games since the last report, i.e., the last
+   * 'block' games
    *
    * the format would be
    * 1000   avg = 273901, max = 382324, ops = 241563 (170543|896715)
+   *        player latency (us): p50 = 5, p90 = 6, p99 = 9, p99.9 = 23, max = 81
    *        512     100%   (0.3%)
    *        1024    99.7%  (0.2%)
    *        2048    99.5%  (1.1%)
@@ -41,48 +218,109 @@ public:
    *  'ops = 241563 (170543|896715)': the average speed is 241563
    *                                  the average speed of player is 170543
    *                                  the average speed of environment is 896715
+   *  'player latency (us)': the percentiles of the time of the player moves,
+   *                         also of the environment moves, unless not timed
    *  '93.7%': 93.7% (937 games) reached 8192-tiles (a.k.a. win rate of
    * 8192-tile) '22.4%': 22.4% (224 games) terminated with 8192-tiles (the
    * largest)
    */
-  void show(bool tstat = true) const {
-    size_t blk = std::min(data.size(), block);
-    size_t stat[64] = {0};
-    size_t sop = 0, pop = 0, eop = 0;
-    time_t sdu = 0, pdu = 0, edu = 0;
+  void show(bool tstat = true) const { show(recent, tstat, true); }
+
+  /**
+   * show the statistic of all the episodes, including the ones no longer
+   * saved because of 'limit'
+   */
+  void summary() const { show(overall); }
+
+  bool is_finished() const { return count >= total; }
+
+private:
+  /**
+   * the running sums of the episodes of a block, folded in as each episode
+   * closes, so that a report does not rescan the moves of the games
+   */
+  struct aggregate {
+    size_t games = 0;
     board::reward_t sum = 0, max = 0;
-    auto it = data.end();
-    for (size_t i = 0; i < blk; i++) {
-      auto &ep = *(--it);
+    size_t sop = 0, pop = 0, eop = 0;
+    time_t sdu = 0, pdu = 0, edu = 0; // in ms, in us, in us
+    size_t stat[64] = {0};
+    latency_histogram play, evil;
+
+    void fold(const episode &ep) {
+      games++;
       sum += ep.score();
       max = std::max(ep.score(), max);
       stat[ep.state().max_tile()]++;
       sop += ep.step();
-      pop += ep.step(action::slide::type);
-      eop += ep.step(action::place::type);
       sdu += ep.time();
-      pdu += ep.time(action::slide::type);
-      edu += ep.time(action::place::type);
+      // the moves by their type, since the environment places 9 tiles first
+      for (const episode::move &mv : ep.ep_moves) {
+        if (action(mv).type() == action::slide::type) {
+          pop++, pdu += mv.time;
+          play.record(mv.time);
+        } else {
+          eop++, edu += mv.time;
+          evil.record(mv.time);
+        }
+      }
     }
+  };
 
+  /**
+   * show an aggregate, and the throughput of the training threads if it is
+   * the one of the current block, since the threads are counted per block
+   */
+  void show(const aggregate &agg, bool tstat = true,
+            bool block = false) const {
+    size_t blk = agg.games;
     std::ios ff(nullptr);
     ff.copyfmt(std::cout);
     std::cout << std::fixed << std::setprecision(0);
     std::cout << count << "\t";
-    std::cout << "avg = " << (sum / blk) << ", ";
-    std::cout << "max = " << (max) << ", ";
-    std::cout << "ops = " << (sop * 1000.0 / sdu);
-    std::cout << " (" << (pop * 1000.0 / pdu);
-    std::cout << "|" << (eop * 1000.0 / edu) << ")";
+    std::cout << "avg = " << (agg.sum / blk) << ", ";
+    std::cout << "max = " << (agg.max) << ", ";
+    std::cout << "ops = " << (agg.sop * 1000.0 / agg.sdu);
+    std::cout << " (" << (agg.pop * 1000000.0 / agg.pdu);
+    std::cout << "|" << (agg.eop * 1000000.0 / agg.edu) << ")";
     std::cout << std::endl;
+    if (note.size())
+      std::cout << "\t" << note << std::endl;
+    for (const latency_histogram *h : {&agg.play, &agg.evil}) {
+      if (h->max() == 0)
+        continue;
+      std::cout << "\t" << (h == &agg.play ? "player" : "environment")
+                << " latency (us): ";
+      std::cout << "p50 = " << h->percentile(0.5) << ", ";
+      std::cout << "p90 = " << h->percentile(0.9) << ", ";
+      std::cout << "p99 = " << h->percentile(0.99) << ", ";
+      std::cout << "p99.9 = " << h->percentile(0.999) << ", ";
+      std::cout << "max = " << h->max() << std::endl;
+    }
+    if (block && workers.size() > 1) {
+      time_t wall = std::max<time_t>(episode::millisec() - since, 1);
+      std::cout << "\tthreads = " << workers.size() << ", ";
+      std::cout << "eps = " << (blk * 1000.0 / wall) << " (";
+      for (size_t i = 0; i < workers.size(); i++)
+        std::cout << (i ? "|" : "") << (workers[i].episodes * 1000.0 / wall);
+      std::cout << ")" << std::endl;
+      for (size_t i = 0; i < workers.size(); i++) {
+        if (workers[i].time == 0)
+          continue;
+        std::cout << "\t#" << i << "\t" << workers[i].episodes << " games, ";
+        std::cout << "ops = " << (workers[i].steps * 1000.0 / workers[i].time);
+        std::cout << std::endl;
+      }
+    }
     std::cout.copyfmt(ff);
 
     if (!tstat)
       return;
+    const size_t *stat = agg.stat;
     for (size_t t = 0, c = 0; c < blk; c += stat[t++]) {
       if (stat[t] == 0)
         continue;
-      unsigned accu = std::accumulate(std::begin(stat) + t, std::end(stat), 0);
+      unsigned accu = std::accumulate(stat + t, stat + 64, 0);
       std::cout << "\t" << (t <= 3 ? t : 3 * (1 << (t - 3))); // type
       std::cout << "\t" << (accu * 100.0 / blk) << "%";       // win rate
       std::cout << "\t"
@@ -95,56 +333,234 @@ public:
     std::cout << std::endl;
   }
 
-  void summary() const {
-    auto block_temp = block;
-    const_cast<statistic &>(*this).block = data.size();
-    show();
-    const_cast<statistic &>(*this).block = block_temp;
+public:
+  /**
+   * reserve an episode, whose index is stored in 'n', return false if all the
+   * episodes have been reserved
+   */
+  bool reserve(size_t &n) { return (n = issued++) < total; }
+
+  /**
+   * annotate the statistic with the configuration of the run, e.g., the
+   * storage of the weights, which is shown along with the speed
+   */
+  void annotate(const std::string &note) { this->note = note; }
+
+  /**
+   * stream the episodes to 'path' as they close, including the ones loaded
+   * afterwards, in text or as a binary log, see episode_sink
+   */
+  void stream(const std::string &path, bool binary) {
+    sink.reset(new episode_sink(path));
+    this->binary = binary;
+    if (binary) {
+      std::ostringstream ss;
+      episode_log::header(ss);
+      sink->push(ss.str());
+    }
   }
 
-  bool is_finished() const { return count >= total; }
+  /**
+   * record episode 'n' finished by thread 'id' out of 'threads'
+   * the episodes are merged in the order of their indices, i.e., the ones
+   * finished ahead of an earlier one wait in 'pending', so that the saved
+   * episodes and the reports are the same as the ones of a serial run
+   */
+  void commit(episode &&ep, size_t n, size_t id, size_t threads) {
+    std::lock_guard<std::mutex> lock(mutex);
+    workers.resize(std::max(workers.size(), threads));
+    workers[id].episodes++;
+    workers[id].steps += ep.step();
+    workers[id].time += ep.time();
+    pending.emplace(n, std::move(ep));
+    for (auto it = pending.begin();
+         it != pending.end() && it->first == count; it = pending.erase(it)) {
+      recent.fold(it->second);
+      record(it->second);
+      slot(std::move(it->second));
+      if (++count % block == 0) {
+        show();
+        recent = {};
+        workers.assign(workers.size(), {});
+        since = episode::millisec();
+      }
+    }
+  }
 
   void open_episode(const std::string &flag = "") {
-    if (count++ >= limit)
-      data.pop_front();
-    data.emplace_back();
-    data.back().open_episode(flag);
+    count++;
+    slot().open_episode(flag);
   }
 
   void close_episode(const std::string &flag = "") {
-    data.back().close_episode(flag);
-    if (count % block == 0)
+    back().close_episode(flag);
+    recent.fold(back());
+    record(back());
+    if (count % block == 0) {
       show();
+      recent = {};
+    }
   }
 
-  episode &at(size_t i) {
-    auto it = data.begin();
-    while (i--)
-      it++;
-    return *it;
-  }
-  episode &front() { return data.front(); }
-  episode &back() { return data.back(); }
+  /**
+   * the saved episodes from the oldest, at most 'limit' of the latest ones
+   */
+  size_t size() const { return data.size(); }
+  episode &at(size_t i) { return data[(head + i) % data.size()]; }
+  const episode &at(size_t i) const { return data[(head + i) % data.size()]; }
+  episode &front() { return at(0); }
+  episode &back() { return at(data.size() - 1); }
 
   friend std::ostream &operator<<(std::ostream &out, const statistic &stat) {
-    for (const episode &rec : stat.data)
-      out << rec << std::endl;
+    for (size_t i = 0; i < stat.size(); i++)
+      out << stat.at(i) << std::endl;
     return out;
   }
+  /**
+   * load a file of episodes as operator>> does, but map the file and parse
+   * the lines of text by 'threads' in parallel, a batch at a time
+   * return false if the file cannot be mapped
+   */
+  bool load(const std::string &path, size_t threads = 1) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || ::fstat(fd, &st) == -1 || st.st_size == 0) {
+      if (fd != -1)
+        ::close(fd);
+      return fd != -1;
+    }
+    size_t size = st.st_size;
+    void *addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED)
+      return false;
+    const char *first = static_cast<const char *>(addr), *last = first + size;
+    if (size > std::strlen(episode_log::magic()) &&
+        std::strcmp(first, episode_log::magic()) == 0) {
+      ::munmap(addr, size);
+      std::ifstream in(path, std::ios::in | std::ios::binary);
+      in >> *this;
+      return true;
+    }
+    ::madvise(addr, size, MADV_SEQUENTIAL);
+
+    threads = std::max<size_t>(threads, 1);
+    std::vector<std::pair<const char *, const char *>> lines;
+    std::vector<episode> batch;
+    size_t n = count;
+    for (const char *p = first; p != last;) {
+      lines.clear();
+      while (p != last && lines.size() < threads * 1024) {
+        const char *eol = std::find(p, last, '\n');
+        if (eol == p)
+          break; // an empty line ends the episodes
+        lines.emplace_back(p, eol);
+        p = std::min(eol + 1, last);
+      }
+      if (lines.empty())
+        break;
+      batch.assign(lines.size(), episode());
+      std::vector<std::thread> parsers;
+      for (size_t id = 0; id < threads; id++) {
+        parsers.emplace_back([&, id]() {
+          for (size_t i = id; i < lines.size(); i += threads) {
+            const char *b = lines[i].first, *e = lines[i].second;
+            if (!batch[i].parse(b, e))
+              std::stringstream(std::string(b, e)) >> batch[i];
+          }
+        });
+      }
+      for (std::thread &parser : parsers)
+        parser.join();
+      for (episode &ep : batch) {
+        total = std::max(total, ++n);
+        record(ep);
+        slot(std::move(ep));
+      }
+      if (lines.size() < threads * 1024)
+        break;
+    }
+    ::munmap(addr, size);
+    count = n;
+    issued = count;
+    return true;
+  }
+
   friend std::istream &operator>>(std::istream &in, statistic &stat) {
-    for (std::string line; std::getline(in, line) && line.size();) {
-      stat.data.emplace_back();
-      std::stringstream(line) >> stat.data.back();
+    size_t n = 0;
+    if (episode_log::header(in)) {
+      episode_log log;
+      for (episode ep; log.read(in, ep); n++) {
+        stat.total = std::max(stat.total, n + 1);
+        stat.record(ep);
+        stat.slot(std::move(ep));
+      }
+    }
+    for (std::string line; std::getline(in, line) && line.size(); n++) {
+      stat.total = std::max(stat.total, n + 1);
+      std::stringstream(line) >> stat.slot();
+      stat.record(stat.back());
     }
-    stat.total = std::max(stat.total, stat.data.size());
-    stat.count = stat.data.size();
+    stat.count = n;
+    stat.issued = stat.count;
     return in;
   }
 
 private:
   size_t total;
   size_t block;
-  size_t limit;
+  size_t limit; // 0 for all the episodes
   size_t count;
-  std::list<episode> data;
+  // the ring of the saved episodes, where 'head' is the oldest once full
+  std::vector<episode> data;
+  size_t head;
+  aggregate recent;
+  aggregate overall; // of all the episodes, for the summary
+  std::string note;
+
+  // block throughput of the training threads
+  struct worker {
+    size_t episodes = 0, steps = 0;
+    time_t time = 0;
+  };
+  std::atomic<size_t> issued;
+  std::mutex mutex;
+  std::vector<worker> workers;
+  std::map<size_t, episode> pending; // finished, but not merged yet
+  time_t since;
+
+  std::unique_ptr<episode_sink> sink;
+  episode_log log;
+  bool binary = false;
+
+  /**
+   * fold a closed episode into the summary, and serialize it to the sink, if
+   * any
+   */
+  void record(const episode &ep) {
+    overall.fold(ep);
+    if (!sink)
+      return;
+    std::ostringstream ss;
+    if (binary)
+      log.write(ss, ep);
+    else
+      ss << ep << '\n';
+    sink->push(ss.str());
+  }
+
+  size_t capacity() const { return limit ? limit : total; }
+
+  /**
+   * save a new episode, which replaces the oldest one if full
+   */
+  episode &slot(episode &&ep = episode()) {
+    if (data.size() < capacity()) {
+      data.push_back(std::move(ep));
+      return data.back();
+    }
+    episode &old = data[head];
+    head = (head + 1) % data.size();
+    return old = std::move(ep);
+  }
 };
@@ -3,12 +3,43 @@
 #include "board.h"
 #include "episode.h"
 #include "statistic.h"
-#include <fstream>
 #include <iostream>
 #include <iterator>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
-int main(int argc, const char *argv[]) {
+/**
+ * play an episode on 'game' and return the winner
+ */
+agent &play_episode(episode &game, agent &play, rndenv &evil) {
+  for (size_t i = 0; i < 9; ++i) {
+    game.take_turns(play, evil);
+    game.apply_action(evil.init_action(i));
+  }
+  unsigned move_;
+  while (true) {
+    // std::cout << game.step(-1) << "URDL"[move_] << game.state() <<
+    // std::endl;
+    agent &who = game.take_turns(play, evil);
+    // the game is over if the player has no legal move
+    if (&who == &play && !game.state().slides().legal) {
+      break;
+    }
+    action move = who.take_action(game.state(), move_);
+    move_ = move.event() & 0b11;
+    if (!game.apply_action(move)) {
+      break;
+    }
+    if (who.check_for_win(game.state())) {
+      break;
+    }
+  }
+  return game.last_turns(play, evil);
+}
+
+int main(int argc, const char *argv[]) try {
   // show arguments
   std::cout << "Threes-Demo: ";
   std::copy(argv, argv + argc,
@@ -16,10 +47,10 @@ int main(int argc, const char *argv[]) {
   std::cout << std::endl << std::endl;
 
   // parse arguments
-  size_t total = 1000, block = 0, limit = 0;
+  size_t total = 1000, block = 0, limit = 0, threads = 1;
   std::string play_args, evil_args;
-  std::string load, save;
-  bool summary = false;
+  std::string load, save, format = "text";
+  bool summary = false, limited = false;
   for (int i = 1; i < argc; i++) {
     std::string para(argv[i]);
     if (para.find("--total=") == 0) {
@@ -28,6 +59,9 @@ int main(int argc, const char *argv[]) {
       block = std::stoull(para.substr(para.find('=') + 1));
     } else if (para.find("--limit=") == 0) {
       limit = std::stoull(para.substr(para.find('=') + 1));
+      limited = true;
+    } else if (para.find("--threads=") == 0) {
+      threads = std::stoull(para.substr(para.find('=') + 1));
     } else if (para.find("--play=") == 0) {
       play_args = para.substr(para.find('=') + 1);
     } else if (para.find("--evil=") == 0) {
@@ -36,50 +70,52 @@ int main(int argc, const char *argv[]) {
       load = para.substr(para.find('=') + 1);
     } else if (para.find("--save=") == 0) {
       save = para.substr(para.find('=') + 1);
+    } else if (para.find("--timer=") == 0) {
+      std::string name = para.substr(para.find('=') + 1);
+      if (!timer::select(name))
+        throw std::invalid_argument("unknown timer: " + name);
+    } else if (para.find("--format=") == 0) {
+      format = para.substr(para.find('=') + 1);
     } else if (para.find("--summary") == 0) {
       summary = true;
     }
   }
 
+  // the episodes are streamed to the file, hence only the latest ones are kept
+  // in memory unless '--limit' is given, e.g., '--limit=0' for all of them,
+  // while the summary always covers all the episodes
+  if (!save.empty() && !limited)
+    limit = 1000;
   statistic stat(total, block, limit);
+  if (!save.empty())
+    stat.stream(save, format == "bin");
 
   // load statistic
   if (!load.empty()) {
-    std::ifstream in(load, std::ios::in);
-    in >> stat;
-    in.close();
+    stat.load(load, threads);
     summary |= stat.is_finished();
   }
 
   // deep_greedy_player play(play_args);
   tdl_agent play(play_args);
   rndenv evil(evil_args);
+  // show the storage of the weights, including the pages actually backing
+  // them, once at startup and along with the speed in the reports
+  std::string storage = "weights = " + play.property("weights") + ", " +
+                        play.property("footprint") + ", " +
+                        play.property("pages") +
+                        (play.property("tc") == "1" ? ", tc" : "");
+  std::cout << storage << std::endl << std::endl;
+  stat.annotate(storage);
 
-  while (!stat.is_finished()) {
+  for (size_t n; threads <= 1 && stat.reserve(n);) {
+    evil.seek(n);
     play.open_episode("~:" + evil.name());
     evil.open_episode(play.name() + ":~");
 
     stat.open_episode(play.name() + ":" + evil.name());
     episode &game = stat.back();
-    for (size_t i = 0; i < 9; ++i) {
-      game.take_turns(play, evil);
-      game.apply_action(evil.init_action(i));
-    }
-    unsigned move_;
-    while (true) {
-      // std::cout << game.step(-1) << "URDL"[move_] << game.state() <<
-      // std::endl;
-      agent &who = game.take_turns(play, evil);
-      action move = who.take_action(game.state(), move_);
-      move_ = move.event() & 0b11;
-      if (!game.apply_action(move)) {
-        break;
-      }
-      if (who.check_for_win(game.state())) {
-        break;
-      }
-    }
-    agent &win = game.last_turns(play, evil);
+    agent &win = play_episode(game, play, evil);
     stat.close_episode(win.name());
 
     play.update_episode();
@@ -88,17 +124,44 @@ int main(int argc, const char *argv[]) {
     evil.close_episode(win.name());
   }
 
+  // lock-free parallel training, all the workers update the shared weights,
+  // or parallel evaluation (alpha=0), where the weights are read-only and the
+  // episodes are the same as the ones of a serial run of the same seed
+  std::vector<std::thread> workers;
+  for (size_t id = 0; threads > 1 && id < threads; id++) {
+    workers.emplace_back([&, id]() {
+      tdl_agent play_(play, id);
+      rndenv evil_(evil_args);
+      for (size_t n; stat.reserve(n);) {
+        evil_.seek(n);
+        play_.open_episode("~:" + evil_.name());
+        evil_.open_episode(play_.name() + ":~");
+
+        episode game;
+        game.open_episode(play_.name() + ":" + evil_.name());
+        agent &win = play_episode(game, play_, evil_);
+        game.close_episode(win.name());
+
+        play_.update_episode();
+        stat.commit(std::move(game), n, id, threads);
+
+        play_.close_episode(win.name());
+        evil_.close_episode(win.name());
+      }
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+
   // show statistic
   if (summary) {
     stat.summary();
   }
 
-  // save statistic
-  if (!save.empty()) {
-    std::ofstream out(save, std::ios::out | std::ios::trunc);
-    out << stat;
-    out.close();
-  }
-
   return 0;
+} catch (const std::invalid_argument &e) {
+  // a bad argument, e.g., an unknown value of an option
+  std::cerr << e.what() << std::endl;
+  return 1;
 }
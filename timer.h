@@ -0,0 +1,83 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/**
+ * the clock of the move times in microseconds, selected once for the process
+ *
+ *   system: std::chrono::system_clock, truncated to milliseconds as the judge
+ *           format records them
+ *   steady: std::chrono::steady_clock
+ *   tsc:    the time stamp counter, calibrated against steady_clock at the
+ *           first use, or steady_clock if the CPU has no TSC
+ *   off:    no clock at all, every move takes 0
+ */
+struct timer {
+  enum mode_t { off, system, steady, tsc };
+
+  static mode_t mode() { return current(); }
+  static void select(mode_t m) {
+    current() = m;
+    if (m == tsc)
+      tsc_now(); // calibrate before the first move
+  }
+  static bool select(const std::string &name) {
+    const char *names[] = {"off", "system", "steady", "tsc"};
+    for (int m = off; m <= tsc; m++) {
+      if (name == names[m]) {
+        select(mode_t(m));
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static int64_t now() {
+    switch (current()) {
+    case system:
+      return std::chrono::duration_cast<std::chrono::milliseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+                 .count() *
+             1000;
+    case steady:
+      return steady_now();
+    case tsc:
+      return tsc_now();
+    default:
+      return 0;
+    }
+  }
+
+private:
+  static mode_t &current() {
+    static mode_t m = steady;
+    return m;
+  }
+
+  static int64_t steady_now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  static int64_t tsc_now() {
+    static const double us_per_tick = calibrate();
+    return int64_t(double(__builtin_ia32_rdtsc()) * us_per_tick);
+  }
+
+  /**
+   * count the ticks of 20 ms of steady_clock
+   */
+  static double calibrate() {
+    int64_t t0 = steady_now(), c0 = __builtin_ia32_rdtsc();
+    while (steady_now() - t0 < 20000)
+      ;
+    int64_t t1 = steady_now(), c1 = __builtin_ia32_rdtsc();
+    return double(t1 - t0) / double(c1 - c0);
+  }
+#else
+  static int64_t tsc_now() { return steady_now(); }
+#endif
+};
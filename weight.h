@@ -0,0 +1,447 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * the memory policy of an allocated weight table
+ *
+ * pages:
+ *   4k:  the default pages
+ *   thp: transparent huge pages, i.e., madvise(MADV_HUGEPAGE)
+ *   2m:  2 MB pages from hugetlbfs, falls back to thp
+ *   1g:  1 GB pages from hugetlbfs, falls back to 2m
+ * numa:
+ *   local:      the pages follow the first touch
+ *   interleave: the pages are interleaved across all the online nodes
+ */
+struct weight_policy {
+  enum pages_t { normal, transparent, huge_2m, huge_1g };
+  pages_t pages = transparent;
+  bool interleave = false;
+
+  weight_policy() = default;
+  weight_policy(const std::string &pages, const std::string &numa)
+      : pages(pages == "4k"   ? normal
+              : pages == "2m" ? huge_2m
+              : pages == "1g" ? huge_1g
+                              : transparent),
+        interleave(numa == "interleave") {}
+
+  bool operator==(const weight_policy &p) const {
+    return pages == p.pages && interleave == p.interleave;
+  }
+  bool operator!=(const weight_policy &p) const { return !(*this == p); }
+
+  std::string name() const {
+    static const char *names[] = {"4k", "thp", "2m", "1g"};
+    return std::string(names[pages]) + (interleave ? " interleave" : " local");
+  }
+};
+
+/**
+ * the storage of a weight table
+ * either allocated and owned, or a view into a mapped weight file
+ *
+ * the weights are stored as
+ *   fp32: float
+ *   fp16: IEEE half precision
+ *   q16:  16-bit fixed point, in steps of scale(), for inference only
+ * and always accumulated as float, see weight_codec
+ */
+class weight_table {
+public:
+  enum storage_t { fp32, fp16, q16 };
+
+  weight_table() : size_(0), storage_(fp32), scale_(1), page_(0) {}
+  explicit weight_table(size_t size, storage_t storage = fp32,
+                        float scale = 1.0f / 16,
+                        const weight_policy &policy = {})
+      : size_(size), storage_(storage), scale_(storage == q16 ? scale : 1),
+        policy_(policy), page_(0) {
+    // pad a float, so that the vector paths can gather 16-bit elements as
+    // 32-bit ones
+    allocate(bytes() + sizeof(float));
+  }
+  weight_table(std::shared_ptr<float> data, size_t size)
+      : data_(data, reinterpret_cast<char *>(data.get())), size_(size),
+        storage_(fp32), scale_(1), page_(0) {}
+
+public:
+  template <class type = float> type *data() {
+    return reinterpret_cast<type *>(data_.get());
+  }
+  template <class type = float> const type *data() const {
+    return reinterpret_cast<const type *>(data_.get());
+  }
+  size_t size() const { return size_; }
+  size_t bytes() const { return size_ * (storage_ == fp32 ? 4 : 2); }
+  storage_t storage() const { return storage_; }
+  float scale() const { return scale_; }
+
+  /**
+   * the policy of an allocated table, and the page size it achieved
+   * the page size is 0 for a view into a mapped weight file
+   * 'interleaved' is false if the policy interleaves but mbind failed
+   */
+  const weight_policy &policy() const { return policy_; }
+  size_t page() const { return page_; }
+  bool interleaved() const { return interleaved_; }
+
+  static storage_t storage(const std::string &name) {
+    return name == "fp16" ? fp16 : name == "q16" ? q16 : fp32;
+  }
+  static std::string name(storage_t storage) {
+    return storage == fp16 ? "fp16" : storage == q16 ? "q16" : "fp32";
+  }
+
+  /**
+   * the i-th weight as float, regardless of the storage
+   */
+  float at(size_t i) const;
+  void put(size_t i, float v);
+
+  /**
+   * a copy of the table in another storage
+   * the q16 step is the least power of 2 that keeps twice the largest weight
+   */
+  weight_table convert(storage_t storage,
+                       const weight_policy &policy = {}) const;
+
+private:
+  /**
+   * map zeroed anonymous memory as the policy says, and fault it in, so that
+   * the achieved page size can be read back from /proc/self/smaps
+   */
+  void allocate(size_t bytes) {
+    size_t huge = policy_.pages == weight_policy::huge_1g ? 1ull << 30
+                                                          : 1ull << 21;
+    size_t length = (bytes + huge - 1) / huge * huge;
+    size_t span = length; // of the table, from addr
+    char *addr = static_cast<char *>(MAP_FAILED);
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+    for (size_t page = huge; policy_.pages >= weight_policy::huge_2m &&
+                             page >= (1ull << 21) && addr == MAP_FAILED;
+         page >>= 9) {
+      span = length = (bytes + page - 1) / page * page;
+      int shift = __builtin_ctzll(page) << MAP_HUGE_SHIFT;
+      addr = static_cast<char *>(
+          ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | shift, -1, 0));
+    }
+#endif
+    if (addr != MAP_FAILED) {
+      data_.reset(addr, [length](char *addr) { ::munmap(addr, length); });
+    } else if (policy_.pages != weight_policy::normal) {
+      // over-map by a huge page to align the table to it
+      huge = 1ull << 21;
+      length = (bytes + huge - 1) / huge * huge + huge;
+      char *base = static_cast<char *>(
+          ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+      if (base == MAP_FAILED)
+        throw std::bad_alloc();
+      addr = base + (huge - uintptr_t(base) % huge) % huge;
+      span = length - huge;
+#ifdef MADV_HUGEPAGE
+      ::madvise(addr, span, MADV_HUGEPAGE);
+#endif
+      data_.reset(addr, [base, length](char *) { ::munmap(base, length); });
+    } else {
+      span = length = bytes;
+      addr = static_cast<char *>(
+          ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+      if (addr == MAP_FAILED)
+        throw std::bad_alloc();
+      data_.reset(addr, [length](char *addr) { ::munmap(addr, length); });
+    }
+    interleaved_ = !policy_.interleave || interleave(addr, span);
+    for (size_t i = 0; i < bytes; i += 4096)
+      addr[i] = 0;
+    page_ = pagesize(addr);
+  }
+
+  /**
+   * interleave the pages across the online nodes, which is a no-op on a
+   * single-node host, return false if it failed
+   */
+  static bool interleave(void *addr, size_t length) {
+#ifdef SYS_mbind
+    std::ifstream online("/sys/devices/system/node/online");
+    unsigned long mask = 0;
+    for (unsigned lo, hi; online >> lo;) {
+      hi = lo;
+      if (online.peek() == '-')
+        online.ignore() >> hi;
+      for (unsigned node = lo; node <= hi && node < 64; node++)
+        mask |= 1ul << node;
+      online.ignore();
+    }
+    const int mpol_interleave = 3; // MPOL_INTERLEAVE
+    if (mask & (mask - 1))
+      return ::syscall(SYS_mbind, addr, length, mpol_interleave, &mask, 64,
+                       0) == 0;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  /**
+   * the page size backing most of the mapping at addr
+   */
+  static size_t pagesize(const void *addr) {
+    std::ifstream smaps("/proc/self/smaps");
+    size_t rss = 0, kernel = 4, anon_huge = 0;
+    bool found = false;
+    for (std::string line; std::getline(smaps, line);) {
+      unsigned long lo, hi;
+      if (std::sscanf(line.c_str(), "%lx-%lx ", &lo, &hi) == 2) {
+        if (found)
+          break;
+        found = uintptr_t(addr) >= lo && uintptr_t(addr) < hi;
+      } else if (found) {
+        std::sscanf(line.c_str(), "Rss: %zu kB", &rss);
+        std::sscanf(line.c_str(), "KernelPageSize: %zu kB", &kernel);
+        std::sscanf(line.c_str(), "AnonHugePages: %zu kB", &anon_huge);
+      }
+    }
+    if (anon_huge && anon_huge * 2 >= rss)
+      return 2048 << 10;
+    return kernel << 10;
+  }
+
+  std::shared_ptr<char> data_;
+  size_t size_;
+  storage_t storage_;
+  float scale_;
+  weight_policy policy_;
+  size_t page_;
+  bool interleaved_ = false;
+};
+
+/**
+ * the conversion between the stored weights and float
+ * decoding is exact, hence the scalar and the vector paths agree
+ */
+template <weight_table::storage_t storage> struct weight_codec;
+
+template <> struct weight_codec<weight_table::fp32> {
+  using type = float;
+  static float decode(type w, float) { return w; }
+  static type encode(float v, float) { return v; }
+};
+
+template <> struct weight_codec<weight_table::fp16> {
+  using type = uint16_t;
+  static constexpr float rebias = 5.192296858534828e33f; // 2^112
+  static float decode(type w, float) {
+    // rebias the exponent by scaling, which also handles the subnormals
+    uint32_t bits = uint32_t(w & 0x7fff) << 13;
+    float v;
+    std::memcpy(&v, &bits, sizeof(v));
+    v *= rebias;
+    return (w & 0x8000) ? -v : v;
+  }
+  static type encode(float v, float) {
+    uint32_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    type sign = (bits >> 16) & 0x8000;
+    float a = std::fabs(v);
+    if (!(a < 65520.0f)) // saturate, also for nan
+      return sign | 0x7bff;
+    if (a < 6.103515625e-05f) // subnormal (< 2^-14), in steps of 2^-24
+      return sign | type(std::nearbyint(a * 16777216.0f));
+    std::memcpy(&bits, &a, sizeof(bits));
+    bits += 0x0fff + ((bits >> 13) & 1); // round to nearest even
+    return sign | type((bits - (112u << 23)) >> 13);
+  }
+};
+
+template <> struct weight_codec<weight_table::q16> {
+  using type = int16_t;
+  static float decode(type w, float scale) { return w * scale; }
+  static type encode(float v, float scale) {
+    float q = std::nearbyint(v / scale);
+    return type(std::max(-32767.0f, std::min(q, 32767.0f)));
+  }
+};
+
+inline float weight_table::at(size_t i) const {
+  switch (storage_) {
+  case fp16:
+    return weight_codec<fp16>::decode(data<uint16_t>()[i], scale_);
+  case q16:
+    return weight_codec<q16>::decode(data<int16_t>()[i], scale_);
+  default:
+    return data()[i];
+  }
+}
+
+inline void weight_table::put(size_t i, float v) {
+  switch (storage_) {
+  case fp16:
+    data<uint16_t>()[i] = weight_codec<fp16>::encode(v, scale_);
+    break;
+  case q16:
+    data<int16_t>()[i] = weight_codec<q16>::encode(v, scale_);
+    break;
+  default:
+    data()[i] = v;
+    break;
+  }
+}
+
+inline weight_table weight_table::convert(storage_t storage,
+                                          const weight_policy &policy) const {
+  float max = 0;
+  for (size_t i = 0; i < size_; i++)
+    max = std::max(max, std::fabs(at(i)));
+  float scale = 1.0f / 16, least = 1.0f / 65536;
+  while (max * 2 > scale * 32767)
+    scale *= 2;
+  while (max && max * 4 <= scale * 32767 && scale > least)
+    scale /= 2;
+  weight_table table(size_, storage, scale, policy);
+  for (size_t i = 0; i < size_; i++)
+    table.put(i, at(i));
+  return table;
+}
+
+/**
+ * the page-aligned weight file, which is mapped instead of read
+ *
+ * layout (little-endian):
+ *   header, entry[count]      padded to a page
+ *   weights of entry 0        padded to a page
+ *   weights of entry 1        padded to a page
+ *   ...
+ *
+ * a read-only mapping shares the page cache among all the processes, and a
+ * writable mapping is copy-on-write, so the file is never modified
+ */
+class weight_file {
+public:
+  struct header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+  };
+  struct entry {
+    char name[52];
+    uint32_t length; // of name
+    uint64_t offset; // in bytes from the beginning of the file
+    uint64_t size;   // in floats
+  };
+  static const char *magic() { return "TDLWMAP"; }
+  static constexpr uint32_t version = 1;
+  static constexpr size_t page = 4096;
+
+public:
+  /**
+   * map a weight file, or return an empty file if it is not in this format
+   */
+  static weight_file map(const std::string &path, bool writable) {
+    weight_file file;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+      return file;
+    struct stat st;
+    header head;
+    if (::fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(head) &&
+        ::pread(fd, &head, sizeof(head), 0) == sizeof(head) &&
+        std::memcmp(head.magic, magic(), sizeof(head.magic)) == 0 &&
+        head.version == version) {
+      int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+      int flags = writable ? MAP_PRIVATE : MAP_SHARED;
+      size_t size = st.st_size;
+      void *addr = ::mmap(nullptr, size, prot, flags, fd, 0);
+      if (addr != MAP_FAILED) {
+        file.base_ = std::shared_ptr<char>(
+            static_cast<char *>(addr),
+            [size](char *addr) { ::munmap(addr, size); });
+        file.size_ = size;
+      }
+    }
+    ::close(fd);
+    return file;
+  }
+
+  explicit operator bool() const { return bool(base_); }
+
+  /**
+   * the weight table of the entry 'name', or an empty table if not found
+   */
+  weight_table find(const std::string &name) const {
+    const header &head = *reinterpret_cast<const header *>(base_.get());
+    const entry *ent = reinterpret_cast<const entry *>(&head + 1);
+    for (uint32_t i = 0; i < head.count; i++, ent++) {
+      if (std::string(ent->name, ent->length) != name)
+        continue;
+      if (ent->offset % page || ent->offset + ent->size * sizeof(float) > size_)
+        break;
+      float *data = reinterpret_cast<float *>(base_.get() + ent->offset);
+      return {std::shared_ptr<float>(base_, data), ent->size};
+    }
+    return {};
+  }
+
+  /**
+   * write the named weight tables
+   * an entry is the raw bytes of its table, so a table other than fp32 is
+   * written as the floats of the same bytes, e.g., the 16-bit pairs of
+   * accumulators of TC learning
+   */
+  static void
+  write(std::ostream &out,
+        const std::vector<std::pair<std::string, const weight_table *>> &w) {
+    header head{};
+    std::memcpy(head.magic, magic(), sizeof(head.magic));
+    head.version = version;
+    head.count = w.size();
+    std::vector<entry> ent(w.size());
+    uint64_t offset = align(sizeof(head) + sizeof(entry) * w.size());
+    for (size_t i = 0; i < w.size(); i++) {
+      const std::string &name = w[i].first;
+      ent[i].length = std::min(name.length(), sizeof(ent[i].name));
+      std::memcpy(ent[i].name, name.data(), ent[i].length);
+      ent[i].offset = offset;
+      ent[i].size = w[i].second->bytes() / sizeof(float);
+      offset = align(offset + ent[i].size * sizeof(float));
+    }
+    out.write(reinterpret_cast<const char *>(&head), sizeof(head));
+    out.write(reinterpret_cast<const char *>(ent.data()),
+              sizeof(entry) * ent.size());
+    for (size_t i = 0; i < w.size(); i++) {
+      pad(out, ent[i].offset);
+      out.write(w[i].second->template data<char>(),
+                sizeof(float) * ent[i].size);
+    }
+    pad(out, offset);
+  }
+
+private:
+  static uint64_t align(uint64_t offset) {
+    return (offset + page - 1) / page * page;
+  }
+  static void pad(std::ostream &out, uint64_t offset) {
+    static const char zero[page] = {};
+    out.write(zero, offset - out.tellp());
+  }
+
+  std::shared_ptr<char> base_;
+  size_t size_ = 0;
+};